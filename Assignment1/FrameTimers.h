@@ -0,0 +1,607 @@
+//
+//  Frame timing: GPU timer queries, CPU timers and an on-screen overlay
+//
+//  A frame is split into named phases. Each phase is timed on the CPU with
+//  a steady clock and, when it issues GL work, on the GPU with a
+//  GL_TIME_ELAPSED query. Query results arrive a few frames late, so each
+//  frame gets its own slot in a ring of QueryFrames slots and a slot is
+//  read back only when it comes round again. Even then the results are
+//  taken only if GL_QUERY_RESULT_AVAILABLE says so: a frame still in flight
+//  is recorded without GPU times rather than waited for.
+//
+//  For every frame the timers keep the frame time (start to start), the
+//  CPU time from beginFrame() to endFrame(), the GPU time (the sum of the
+//  phases' queries) and each phase's own times. The overlay shows the
+//  50th, 95th and 99th percentiles over the last WindowFrames frames, drawn
+//  with a built-in 5x7 pixel font; writeCsv() saves every frame kept.
+//
+//  GPU phases cannot nest (one GL_TIME_ELAPSED query runs at a time) and
+//  each phase is timed on the GPU once a frame; CPU times add up over
+//  every time a phase runs. Include after Angel.h.
+//
+
+#ifndef FRAME_TIMERS_H
+#define FRAME_TIMERS_H
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+
+class FrameTimers {
+public:
+    static const int MaxPhases = 8;
+    static const int QueryFrames = 4;             // slots in the query ring
+    static const int WindowFrames = 240;          // frames in the percentiles
+    static const size_t HistoryFrames = 1 << 16;  // frames kept for writeCsv()
+    static const int StatsInterval = 30;          // frames between overlay updates
+
+    // 'phases' name the phases in the order of the overlay and the CSV
+    // columns (MaxPhases at most); the names must outlive the timers. No
+    // GL calls are made before the first beginFrame().
+    explicit FrameTimers(const std::vector<const char*>& phases)
+        : phaseNames(phases.begin(), phases.begin() + std::min(phases.size(), size_t(MaxPhases))) {}
+
+    // Starts a frame. Ends the previous frame's frame time and collects the
+    // GPU times of the frame that last used this frame's query slot.
+    void beginFrame() {
+        Clock::time_point now = Clock::now();
+        if (!queriesCreated) {
+            for (Slot& slot : slots) glGenQueries(MaxPhases, slot.queries);
+            queriesCreated = true;
+        }
+        if (frameCount > 0) {
+            slots[current].record.frameMs = milliseconds(frameStart, now);
+        }
+        current = int(frameCount % QueryFrames);
+        Slot& slot = slots[current];
+        if (slot.pending) {
+            collect(slot);
+        }
+        slot.record = FrameRecord();
+        slot.record.frame = frameCount;
+        std::fill(slot.issued, slot.issued + MaxPhases, false);
+        slot.pending = true;
+        frameStart = now;
+        frameCount++;
+    }
+
+    // Ends the frame's CPU time (call before swapping buffers)
+    void endFrame() {
+        slots[current].record.cpuMs = milliseconds(frameStart, Clock::now());
+    }
+
+    void beginPhase(int phase, bool gpu = true) {
+        Slot& slot = slots[current];
+        if (gpu && gpuPhase < 0 && !slot.issued[phase]) {
+            glBeginQuery(GL_TIME_ELAPSED, slot.queries[phase]);
+            slot.issued[phase] = true;
+            gpuPhase = phase;
+        }
+        phaseStart[phase] = Clock::now();
+    }
+
+    void endPhase(int phase) {
+        slots[current].record.phaseCpuMs[phase] += milliseconds(phaseStart[phase], Clock::now());
+        if (gpuPhase == phase) {
+            glEndQuery(GL_TIME_ELAPSED);
+            gpuPhase = -1;
+        }
+    }
+
+    void toggleOverlay() { overlayVisible = !overlayVisible; }
+
+    // Draws the overlay in the top left corner of the viewport, when shown.
+    // Every piece of GL state it changes is put back.
+    void drawOverlay() {
+        if (!overlayVisible) {
+            return;
+        }
+        if (statsAge >= StatsInterval || overlayLines.empty()) {
+            updateOverlayText();
+        }
+
+        SavedState saved;
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+        glActiveTexture(GL_TEXTURE0 + OverlayTextureUnit);
+        if (overlayProgram == 0 && !createOverlay()) {
+            overlayVisible = false;
+            return;
+        }
+
+        GLint viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        std::vector<OverlayVertex> vertices;
+        size_t columns = 0;
+        for (const std::string& line : overlayLines) columns = std::max(columns, line.size());
+        float margin = float(GlyphScale * 4);
+        float advance = float(GlyphScale * CellWidth), lineHeight = float(GlyphScale * (CellHeight + 2));
+        addQuad(vertices, 0.0f, 0.0f, 2.0f * margin + advance * columns, 2.0f * margin + lineHeight * overlayLines.size(),
+                SolidGlyph, 0.0f, 0.0f, 0.0f, 0.6f);
+        for (size_t row = 0; row < overlayLines.size(); row++) {
+            const std::string& line = overlayLines[row];
+            for (size_t column = 0; column < line.size(); column++) {
+                if (line[column] == ' ') continue;
+                addQuad(vertices, margin + advance * column, margin + lineHeight * row,
+                        float(GlyphScale * GlyphWidth), float(GlyphScale * GlyphHeight),
+                        glyphIndex(line[column]), 1.0f, 1.0f, 1.0f, 1.0f);
+            }
+        }
+
+        glUseProgram(overlayProgram);
+        glUniform2f(overlayViewportSize, float(viewport[2]), float(viewport[3]));
+        glBindVertexArray(overlayVertexArray);
+        glBindBuffer(GL_ARRAY_BUFFER, overlayBuffer);
+        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(OverlayVertex), vertices.data(), GL_STREAM_DRAW);
+        glBindTexture(GL_TEXTURE_2D, fontTexture);
+        glDisable(GL_DEPTH_TEST);
+        glDisable(GL_CULL_FACE);
+        glEnable(GL_BLEND);
+        glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+        glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+        glDrawArrays(GL_TRIANGLES, 0, GLsizei(vertices.size()));
+    }
+
+    // Saves every frame collected so far (HistoryFrames at most), one row
+    // each; times are in milliseconds and left empty when not measured
+    bool writeCsv(const char* filename) const {
+        FILE* file = fopen(filename, "w");
+        if (file == NULL) {
+            std::cerr << "Cannot write frame timings to " << filename << std::endl;
+            return false;
+        }
+        fprintf(file, "frame,frame_ms,cpu_ms,gpu_ms");
+        for (const char* name : phaseNames) fprintf(file, ",%s_cpu_ms,%s_gpu_ms", name, name);
+        fprintf(file, "\n");
+        for (const FrameRecord& record : history) {
+            fprintf(file, "%llu", (unsigned long long)record.frame);
+            writeCsvValue(file, record.frameMs);
+            writeCsvValue(file, record.cpuMs);
+            writeCsvValue(file, record.gpuMs);
+            for (size_t p = 0; p < phaseNames.size(); p++) {
+                writeCsvValue(file, record.phaseCpuMs[p]);
+                writeCsvValue(file, record.phaseGpuMs[p]);
+            }
+            fprintf(file, "\n");
+        }
+        bool written = fclose(file) == 0;
+        if (written) {
+            std::cout << "Wrote " << history.size() << " frame timings to " << filename << std::endl;
+        }
+        return written;
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    // Negative times were not measured
+    struct FrameRecord {
+        uint64_t frame = 0;
+        float frameMs = -1.0f, cpuMs = -1.0f, gpuMs = -1.0f;
+        float phaseCpuMs[MaxPhases] = {};
+        float phaseGpuMs[MaxPhases];
+
+        FrameRecord() { std::fill(phaseGpuMs, phaseGpuMs + MaxPhases, -1.0f); }
+    };
+
+    struct Slot {
+        GLuint queries[MaxPhases];
+        bool issued[MaxPhases];
+        bool pending = false;
+        FrameRecord record;
+    };
+
+    static float milliseconds(Clock::time_point start, Clock::time_point end) {
+        return std::chrono::duration<float, std::milli>(end - start).count();
+    }
+
+    // Moves a slot's frame into the history, with GPU times if every query
+    // has its result
+    void collect(Slot& slot) {
+        bool available = true;
+        for (int p = 0; p < MaxPhases; p++) {
+            if (!slot.issued[p]) continue;
+            GLint ready = 0;
+            glGetQueryObjectiv(slot.queries[p], GL_QUERY_RESULT_AVAILABLE, &ready);
+            available = available && ready != 0;
+        }
+        FrameRecord& record = slot.record;
+        if (available) {
+            for (int p = 0; p < MaxPhases; p++) {
+                if (!slot.issued[p]) continue;
+                GLuint64 nanoseconds = 0;
+                glGetQueryObjectui64v(slot.queries[p], GL_QUERY_RESULT, &nanoseconds);
+                record.phaseGpuMs[p] = float(nanoseconds * 1e-6);
+                record.gpuMs = std::max(record.gpuMs, 0.0f) + record.phaseGpuMs[p];
+            }
+        } else {
+            lateFrames++;
+        }
+        slot.pending = false;
+        history.push_back(record);
+        if (history.size() > HistoryFrames) {
+            history.pop_front();
+        }
+        statsAge++;
+    }
+
+    // Nearest-rank 50th, 95th and 99th percentiles of the measured values
+    // (negative ones are skipped); false if there are none
+    static bool percentiles(std::vector<float>& values, float result[3]) {
+        values.erase(std::remove_if(values.begin(), values.end(), [](float v) { return v < 0.0f; }), values.end());
+        if (values.empty()) {
+            return false;
+        }
+        std::sort(values.begin(), values.end());
+        const double ranks[3] = { 0.50, 0.95, 0.99 };
+        for (int k = 0; k < 3; k++) {
+            size_t rank = size_t(std::ceil(ranks[k] * values.size()));
+            result[k] = values[std::max(rank, size_t(1)) - 1];
+        }
+        return true;
+    }
+
+    template <class Field>
+    void addStatsLine(const char* name, const char* unit, Field field) {
+        size_t window = std::min(history.size(), size_t(WindowFrames));
+        std::vector<float> values;
+        for (size_t i = history.size() - window; i < history.size(); i++) values.push_back(field(history[i]));
+        float p[3];
+        char line[64];
+        if (percentiles(values, p)) {
+            snprintf(line, sizeof(line), "%-10.10s %7.2f %7.2f %7.2f %s", name, p[0], p[1], p[2], unit);
+        } else {
+            snprintf(line, sizeof(line), "%-10.10s %7s %7s %7s %s", name, "-", "-", "-", unit);
+        }
+        overlayLines.push_back(line);
+    }
+
+    // Percentiles of the frame, CPU and GPU times, then of each phase: its
+    // GPU time if it has one, otherwise its CPU time
+    void updateOverlayText() {
+        overlayLines.clear();
+        char line[64];
+        snprintf(line, sizeof(line), "LAST %-5zu %7s %7s %7s", std::min(history.size(), size_t(WindowFrames)),
+                 "P50", "P95", "P99");
+        overlayLines.push_back(line);
+        addStatsLine("FRAME", "MS", [](const FrameRecord& r) { return r.frameMs; });
+        addStatsLine("CPU", "MS", [](const FrameRecord& r) { return r.cpuMs; });
+        addStatsLine("GPU", "MS", [](const FrameRecord& r) { return r.gpuMs; });
+        for (size_t p = 0; p < phaseNames.size(); p++) {
+            bool gpu = false;
+            size_t window = std::min(history.size(), size_t(WindowFrames));
+            for (size_t i = history.size() - window; i < history.size(); i++) gpu = gpu || history[i].phaseGpuMs[p] >= 0.0f;
+            std::string name = std::string(" ") + phaseNames[p];
+            if (gpu) {
+                addStatsLine(name.c_str(), "MS GPU", [p](const FrameRecord& r) { return r.phaseGpuMs[p]; });
+            } else {
+                addStatsLine(name.c_str(), "MS CPU", [p](const FrameRecord& r) { return r.phaseCpuMs[p]; });
+            }
+        }
+        if (lateFrames > 0) {
+            snprintf(line, sizeof(line), "%llu FRAMES WITHOUT GPU TIMES", (unsigned long long)lateFrames);
+            overlayLines.push_back(line);
+        }
+        for (std::string& text : overlayLines) {
+            for (char& c : text) c = char(toupper((unsigned char)c));
+        }
+        statsAge = 0;
+    }
+
+    static void writeCsvValue(FILE* file, float value) {
+        if (value < 0.0f) {
+            fprintf(file, ",");
+        } else {
+            fprintf(file, ",%.4f", value);
+        }
+    }
+
+    //------------------------------------------------------------------------
+    // Overlay drawing
+
+    // Glyphs for ASCII 32 ('\x20') to 95 ('_'), one row of 5 pixels per
+    // byte from the top, leftmost pixel in bit 4; lowercase is drawn as
+    // uppercase. The font texture holds them side by side in cells of
+    // CellWidth x CellHeight texels, followed by one solid cell.
+    static const int GlyphWidth = 5, GlyphHeight = 7;
+    static const int CellWidth = 6, CellHeight = 8;
+    static const int GlyphCount = 64;
+    static const int SolidGlyph = GlyphCount;
+    static const int FontWidth = (GlyphCount + 1) * CellWidth;
+    static const int GlyphScale = 2;          // screen pixels per font pixel
+    static const int OverlayTextureUnit = 15;  // clear of the units the apps use
+
+    static const uint8_t* glyphRows(int glyph) {
+        static const uint8_t glyphs[GlyphCount][GlyphHeight] = {
+            { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  // space
+            { 0x04, 0x04, 0x04, 0x04, 0x04, 0x00, 0x04 },  // !
+            { 0x0A, 0x0A, 0x00, 0x00, 0x00, 0x00, 0x00 },  // "
+            { 0x0A, 0x0A, 0x1F, 0x0A, 0x1F, 0x0A, 0x0A },  // #
+            { 0x04, 0x0F, 0x14, 0x0E, 0x05, 0x1E, 0x04 },  // $
+            { 0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03 },  // %
+            { 0x0C, 0x12, 0x14, 0x08, 0x15, 0x12, 0x0D },  // &
+            { 0x0C, 0x04, 0x08, 0x00, 0x00, 0x00, 0x00 },  // '
+            { 0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02 },  // (
+            { 0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08 },  // )
+            { 0x00, 0x04, 0x15, 0x0E, 0x15, 0x04, 0x00 },  // *
+            { 0x00, 0x04, 0x04, 0x1F, 0x04, 0x04, 0x00 },  // +
+            { 0x00, 0x00, 0x00, 0x00, 0x0C, 0x04, 0x08 },  // ,
+            { 0x00, 0x00, 0x00, 0x1F, 0x00, 0x00, 0x00 },  // -
+            { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C },  // .
+            { 0x01, 0x02, 0x02, 0x04, 0x08, 0x08, 0x10 },  // /
+            { 0x0E, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0E },  // 0
+            { 0x04, 0x0C, 0x04, 0x04, 0x04, 0x04, 0x0E },  // 1
+            { 0x0E, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1F },  // 2
+            { 0x1F, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0E },  // 3
+            { 0x02, 0x06, 0x0A, 0x12, 0x1F, 0x02, 0x02 },  // 4
+            { 0x1F, 0x10, 0x1E, 0x01, 0x01, 0x11, 0x0E },  // 5
+            { 0x06, 0x08, 0x10, 0x1E, 0x11, 0x11, 0x0E },  // 6
+            { 0x1F, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 },  // 7
+            { 0x0E, 0x11, 0x11, 0x0E, 0x11, 0x11, 0x0E },  // 8
+            { 0x0E, 0x11, 0x11, 0x0F, 0x01, 0x02, 0x0C },  // 9
+            { 0x00, 0x0C, 0x0C, 0x00, 0x0C, 0x0C, 0x00 },  // :
+            { 0x00, 0x0C, 0x0C, 0x00, 0x0C, 0x04, 0x08 },  // ;
+            { 0x02, 0x04, 0x08, 0x10, 0x08, 0x04, 0x02 },  // <
+            { 0x00, 0x00, 0x1F, 0x00, 0x1F, 0x00, 0x00 },  // =
+            { 0x08, 0x04, 0x02, 0x01, 0x02, 0x04, 0x08 },  // >
+            { 0x0E, 0x11, 0x01, 0x02, 0x04, 0x00, 0x04 },  // ?
+            { 0x0E, 0x11, 0x17, 0x15, 0x17, 0x10, 0x0F },  // @
+            { 0x0E, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11 },  // A
+            { 0x1E, 0x11, 0x11, 0x1E, 0x11, 0x11, 0x1E },  // B
+            { 0x0E, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0E },  // C
+            { 0x1C, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1C },  // D
+            { 0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x1F },  // E
+            { 0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x10 },  // F
+            { 0x0E, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0F },  // G
+            { 0x11, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11 },  // H
+            { 0x0E, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0E },  // I
+            { 0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0C },  // J
+            { 0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11 },  // K
+            { 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1F },  // L
+            { 0x11, 0x1B, 0x15, 0x15, 0x11, 0x11, 0x11 },  // M
+            { 0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11 },  // N
+            { 0x0E, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E },  // O
+            { 0x1E, 0x11, 0x11, 0x1E, 0x10, 0x10, 0x10 },  // P
+            { 0x0E, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0D },  // Q
+            { 0x1E, 0x11, 0x11, 0x1E, 0x14, 0x12, 0x11 },  // R
+            { 0x0F, 0x10, 0x10, 0x0E, 0x01, 0x01, 0x1E },  // S
+            { 0x1F, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 },  // T
+            { 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E },  // U
+            { 0x11, 0x11, 0x11, 0x11, 0x11, 0x0A, 0x04 },  // V
+            { 0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0A },  // W
+            { 0x11, 0x11, 0x0A, 0x04, 0x0A, 0x11, 0x11 },  // X
+            { 0x11, 0x11, 0x11, 0x0A, 0x04, 0x04, 0x04 },  // Y
+            { 0x1F, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1F },  // Z
+            { 0x0E, 0x08, 0x08, 0x08, 0x08, 0x08, 0x0E },  // [
+            { 0x10, 0x08, 0x08, 0x04, 0x02, 0x02, 0x01 },  // backslash
+            { 0x0E, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0E },  // ]
+            { 0x04, 0x0A, 0x11, 0x00, 0x00, 0x00, 0x00 },  // ^
+            { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1F },  // _
+        };
+        return glyphs[glyph];
+    }
+
+    static int glyphIndex(char c) {
+        int code = toupper((unsigned char)c);
+        return code >= 32 && code < 32 + GlyphCount ? code - 32 : '?' - 32;
+    }
+
+    // Position in pixels from the top left, font texture coordinate, colour
+    struct OverlayVertex {
+        float x, y, s, t;
+        float red, green, blue, alpha;
+    };
+
+    // A quad covering glyph 'glyph' (the whole solid cell for SolidGlyph)
+    static void addQuad(std::vector<OverlayVertex>& vertices, float x, float y, float width, float height,
+                        int glyph, float red, float green, float blue, float alpha) {
+        float s0 = float(glyph * CellWidth) / FontWidth;
+        float s1 = float(glyph * CellWidth + (glyph == SolidGlyph ? CellWidth : GlyphWidth)) / FontWidth;
+        float t1 = glyph == SolidGlyph ? 1.0f : float(GlyphHeight) / CellHeight;
+        const OverlayVertex corners[4] = {
+            { x, y, s0, 0.0f, red, green, blue, alpha },
+            { x + width, y, s1, 0.0f, red, green, blue, alpha },
+            { x + width, y + height, s1, t1, red, green, blue, alpha },
+            { x, y + height, s0, t1, red, green, blue, alpha },
+        };
+        const int order[6] = { 0, 1, 2, 0, 2, 3 };
+        for (int i : order) vertices.push_back(corners[i]);
+    }
+
+    static GLuint compileOverlayShader(GLenum type, const char* source) {
+        GLuint shader = glCreateShader(type);
+        glShaderSource(shader, 1, &source, NULL);
+        glCompileShader(shader);
+        GLint compiled = 0;
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+        if (!compiled) {
+            char log[1024];
+            glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+            std::cerr << "Frame timer overlay shader failed to compile:" << std::endl << log << std::endl;
+            glDeleteShader(shader);
+            return 0;
+        }
+        return shader;
+    }
+
+    // The program, vertex array and font texture, made on first use with
+    // the overlay's texture unit active
+    bool createOverlay() {
+        static const char* vertexSource =
+            "#version 410\n"
+            "layout(location = 0) in vec2 vPosition;\n"
+            "layout(location = 1) in vec2 vTexCoord;\n"
+            "layout(location = 2) in vec4 vColor;\n"
+            "uniform vec2 ViewportSize;\n"
+            "out vec2 texCoord;\n"
+            "out vec4 color;\n"
+            "void main() {\n"
+            "    texCoord = vTexCoord;\n"
+            "    color = vColor;\n"
+            "    gl_Position = vec4(2.0 * vPosition.x / ViewportSize.x - 1.0,\n"
+            "                       1.0 - 2.0 * vPosition.y / ViewportSize.y, 0.0, 1.0);\n"
+            "}\n";
+        static const char* fragmentSource =
+            "#version 410\n"
+            "in vec2 texCoord;\n"
+            "in vec4 color;\n"
+            "uniform sampler2D Font;\n"
+            "out vec4 fcolor;\n"
+            "void main() {\n"
+            "    if (texture(Font, texCoord).r < 0.5) discard;\n"
+            "    fcolor = color;\n"
+            "}\n";
+        GLuint vertexShader = compileOverlayShader(GL_VERTEX_SHADER, vertexSource);
+        GLuint fragmentShader = compileOverlayShader(GL_FRAGMENT_SHADER, fragmentSource);
+        if (vertexShader == 0 || fragmentShader == 0) {
+            return false;
+        }
+        GLuint program = glCreateProgram();
+        glAttachShader(program, vertexShader);
+        glAttachShader(program, fragmentShader);
+        glLinkProgram(program);
+        glDeleteShader(vertexShader);
+        glDeleteShader(fragmentShader);
+        GLint linked = 0;
+        glGetProgramiv(program, GL_LINK_STATUS, &linked);
+        if (!linked) {
+            char log[1024];
+            glGetProgramInfoLog(program, sizeof(log), NULL, log);
+            std::cerr << "Frame timer overlay shader failed to link:" << std::endl << log << std::endl;
+            glDeleteProgram(program);
+            return false;
+        }
+        glUseProgram(program);
+        glUniform1i(glGetUniformLocation(program, "Font"), OverlayTextureUnit);
+        overlayViewportSize = glGetUniformLocation(program, "ViewportSize");
+
+        glGenVertexArrays(1, &overlayVertexArray);
+        glBindVertexArray(overlayVertexArray);
+        glGenBuffers(1, &overlayBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER, overlayBuffer);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(OverlayVertex), BUFFER_OFFSET(offsetof(OverlayVertex, x)));
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(OverlayVertex), BUFFER_OFFSET(offsetof(OverlayVertex, s)));
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(OverlayVertex), BUFFER_OFFSET(offsetof(OverlayVertex, red)));
+
+        // Texel row 0 is the top row of every glyph
+        std::vector<uint8_t> texels(size_t(FontWidth) * CellHeight, 0);
+        for (int glyph = 0; glyph < GlyphCount; glyph++) {
+            const uint8_t* rows = glyphRows(glyph);
+            for (int y = 0; y < GlyphHeight; y++) {
+                for (int x = 0; x < GlyphWidth; x++) {
+                    if (rows[y] & (0x10 >> x)) texels[size_t(y) * FontWidth + glyph * CellWidth + x] = 255;
+                }
+            }
+        }
+        for (int y = 0; y < CellHeight; y++) {
+            std::fill_n(texels.begin() + size_t(y) * FontWidth + SolidGlyph * CellWidth, CellWidth, uint8_t(255));
+        }
+        glGenTextures(1, &fontTexture);
+        glBindTexture(GL_TEXTURE_2D, fontTexture);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, FontWidth, CellHeight, 0, GL_RED, GL_UNSIGNED_BYTE, texels.data());
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        overlayProgram = program;
+        return true;
+    }
+
+    // The state drawOverlay() touches, restored when it goes out of scope
+    struct SavedState {
+        GLint program, vertexArray, arrayBuffer, unpackBuffer, framebuffer;
+        GLint activeTexture, texture, unpackAlignment, unpackRowLength;
+        GLint polygonMode[2], blendSource, blendDestination, blendSourceAlpha, blendDestinationAlpha;
+        GLboolean depthTest, cullFace, blend;
+
+        SavedState() {
+            glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+            glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &vertexArray);
+            glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &arrayBuffer);
+            glGetIntegerv(GL_PIXEL_UNPACK_BUFFER_BINDING, &unpackBuffer);
+            glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &framebuffer);
+            glGetIntegerv(GL_ACTIVE_TEXTURE, &activeTexture);
+            glActiveTexture(GL_TEXTURE0 + OverlayTextureUnit);
+            glGetIntegerv(GL_TEXTURE_BINDING_2D, &texture);
+            glGetIntegerv(GL_UNPACK_ALIGNMENT, &unpackAlignment);
+            glGetIntegerv(GL_UNPACK_ROW_LENGTH, &unpackRowLength);
+            glGetIntegerv(GL_POLYGON_MODE, polygonMode);
+            glGetIntegerv(GL_BLEND_SRC_RGB, &blendSource);
+            glGetIntegerv(GL_BLEND_DST_RGB, &blendDestination);
+            glGetIntegerv(GL_BLEND_SRC_ALPHA, &blendSourceAlpha);
+            glGetIntegerv(GL_BLEND_DST_ALPHA, &blendDestinationAlpha);
+            depthTest = glIsEnabled(GL_DEPTH_TEST);
+            cullFace = glIsEnabled(GL_CULL_FACE);
+            blend = glIsEnabled(GL_BLEND);
+        }
+
+        ~SavedState() {
+            glUseProgram(program);
+            glBindVertexArray(vertexArray);
+            glBindBuffer(GL_ARRAY_BUFFER, arrayBuffer);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, unpackBuffer);
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffer);
+            glActiveTexture(GL_TEXTURE0 + OverlayTextureUnit);
+            glBindTexture(GL_TEXTURE_2D, texture);
+            glActiveTexture(activeTexture);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, unpackAlignment);
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, unpackRowLength);
+            glPolygonMode(GL_FRONT_AND_BACK, polygonMode[0]);
+            glBlendFuncSeparate(blendSource, blendDestination, blendSourceAlpha, blendDestinationAlpha);
+            enable(GL_DEPTH_TEST, depthTest);
+            enable(GL_CULL_FACE, cullFace);
+            enable(GL_BLEND, blend);
+        }
+
+        static void enable(GLenum capability, GLboolean enabled) {
+            if (enabled) {
+                glEnable(capability);
+            } else {
+                glDisable(capability);
+            }
+        }
+    };
+
+    std::vector<const char*> phaseNames;
+    Slot slots[QueryFrames];
+    int current = 0;
+    int gpuPhase = -1;  // phase whose query is running
+    bool queriesCreated = false;
+    uint64_t frameCount = 0, lateFrames = 0;
+    Clock::time_point frameStart, phaseStart[MaxPhases];
+    std::deque<FrameRecord> history;
+
+    bool overlayVisible = false;
+    int statsAge = 0;  // frames collected since the overlay text was made
+    std::vector<std::string> overlayLines;
+    GLuint overlayProgram = 0, overlayVertexArray = 0, overlayBuffer = 0, fontTexture = 0;
+    GLint overlayViewportSize = -1;
+};
+
+// Times a block as one phase, on the GPU too unless 'gpu' is false
+class TimedPhase {
+public:
+    TimedPhase(FrameTimers& timers, int phase, bool gpu = true) : timers(timers), phase(phase) {
+        timers.beginPhase(phase, gpu);
+    }
+    ~TimedPhase() { timers.endPhase(phase); }
+
+private:
+    FrameTimers& timers;
+    int phase;
+};
+
+#endif
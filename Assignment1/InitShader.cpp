@@ -1,5 +1,26 @@
 
 #include "Angel.h"
+#include "InitShader.h"
+#include "TraceProfiler.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
 
 namespace Angel {
 
@@ -25,58 +46,340 @@ readShaderSource(const char* shaderFile)
 }
 
 
+// Insert 'defines' right after the #version line, followed by a #line
+// directive so compiler messages still refer to lines in the file
+static std::string
+injectDefines(const char* source, const char* defines)
+{
+    std::string text(source);
+    if ( defines == NULL || *defines == '\0' ) { return text; }
+
+    size_t insertAt = 0;
+    int line = 1;
+    size_t version = text.find("#version");
+    if ( version != std::string::npos ) {
+	size_t eol = text.find('\n', version);
+	insertAt = (eol == std::string::npos) ? text.size() : eol + 1;
+	for ( size_t i = 0; i < insertAt; ++i ) {
+	    if ( text[i] == '\n' ) { ++line; }
+	}
+    }
+
+    std::string block(defines);
+    if ( block[block.size() - 1] != '\n' ) { block += '\n'; }
+    block += "#line " + std::to_string(line) + "\n";
+    text.insert(insertAt, block);
+    return text;
+}
+
+
 // Create a GLSL program object from vertex and fragment shader files
 GLuint
 InitShader(const char* vShaderFile, const char* fShaderFile)
 {
-    struct Shader {
-	const char*  filename;
-	GLenum       type;
-	GLchar*      source;
-    }  shaders[2] = {
-	{ vShaderFile, GL_VERTEX_SHADER, NULL },
-	{ fShaderFile, GL_FRAGMENT_SHADER, NULL }
-    };
+    return InitShader(vShaderFile, fShaderFile, NULL);
+}
+
+//----------------------------------------------------------------------------
+// Program binary cache
+//
+// Linked programs are saved with glGetProgramBinary under
+// shadercache/<key>.bin, where the key hashes both preprocessed sources and
+// the GL vendor, renderer and version strings. A driver update changes the
+// key, and a binary the driver rejects simply falls back to compiling the
+// sources, so the cache never needs to be cleared by hand.
+
+static const char* const ShaderCacheDir = "shadercache";
+
+struct ProgramBinaryHeader {
+    char      magic[4];      // "GLPB"
+    GLenum    format;
+    GLuint    length;
+    GLuint    reserved;
+    GLuint64  key;
+};
+
+// FNV-1a
+static GLuint64
+hashString(GLuint64 hash, const char* text)
+{
+    if ( text == NULL ) { return hash; }
+    for ( ; *text; ++text ) {
+	hash = (hash ^ (unsigned char)*text) * 0x100000001b3ULL;
+    }
+    return (hash ^ 0xff) * 0x100000001b3ULL;  // separator between strings
+}
 
-    GLuint program = glCreateProgram();
-    
-    for ( int i = 0; i < 2; ++i ) {
-	Shader& s = shaders[i];
-	s.source = readShaderSource( s.filename );
-	if ( shaders[i].source == NULL ) {
-	    std::cerr << "Failed to read " << s.filename << std::endl;
-	    exit( EXIT_FAILURE );
+static GLuint64
+programKey(const std::string& vSource, const std::string& fSource)
+{
+    GLuint64 key = 0xcbf29ce484222325ULL;
+    key = hashString( key, vSource.c_str() );
+    key = hashString( key, fSource.c_str() );
+    key = hashString( key, (const char*) glGetString(GL_VENDOR) );
+    key = hashString( key, (const char*) glGetString(GL_RENDERER) );
+    key = hashString( key, (const char*) glGetString(GL_VERSION) );
+    return key;
+}
+
+static std::string
+programCachePath(GLuint64 key)
+{
+    char name[32];
+    snprintf( name, sizeof(name), "%016llx.bin", (unsigned long long) key );
+    return std::string(ShaderCacheDir) + "/" + name;
+}
+
+static bool
+programBinarySupported()
+{
+    GLint formats = 0;
+    glGetIntegerv( GL_NUM_PROGRAM_BINARY_FORMATS, &formats );
+    return formats > 0;
+}
+
+// Reads a cached binary for 'key', returns false on a miss
+static bool
+readProgramBinary(GLuint64 key, GLenum& format, std::vector<char>& binary)
+{
+    FILE* fp = fopen( programCachePath(key).c_str(), "rb" );
+    if ( fp == NULL ) { return false; }
+
+    // The binary must fill exactly the rest of the file, so a truncated or
+    // corrupt entry is rejected before anything is allocated for it
+    long fileSize = -1;
+    if ( fseek( fp, 0, SEEK_END ) == 0 ) { fileSize = ftell( fp ); }
+    rewind( fp );
+
+    ProgramBinaryHeader header;
+    bool ok = fileSize >= (long) sizeof(header) &&
+	      fread( &header, sizeof(header), 1, fp ) == 1 &&
+	      memcmp( header.magic, "GLPB", 4 ) == 0 && header.key == key &&
+	      header.length > 0 && header.length == (unsigned long) (fileSize - sizeof(header));
+    if ( ok ) {
+	binary.resize( header.length );
+	ok = fread( binary.data(), 1, binary.size(), fp ) == binary.size();
+	format = header.format;
+    }
+    fclose(fp);
+    return ok;
+}
+
+static void
+saveProgramBinary(GLuint program, GLuint64 key)
+{
+    GLint length = 0;
+    glGetProgramiv( program, GL_PROGRAM_BINARY_LENGTH, &length );
+    if ( length <= 0 ) { return; }
+
+    std::vector<char> binary( length );
+    ProgramBinaryHeader header;
+    memcpy( header.magic, "GLPB", 4 );
+    header.reserved = 0;
+    header.key = key;
+    glGetProgramBinary( program, length, NULL, &header.format, binary.data() );
+    header.length = (GLuint) length;
+
+#ifdef _WIN32
+    _mkdir( ShaderCacheDir );
+#else
+    mkdir( ShaderCacheDir, 0755 );
+#endif
+
+    // Write to a temporary name so a crash never leaves a truncated entry
+    std::string path = programCachePath(key);
+    std::string temp = path + ".tmp";
+    FILE* fp = fopen( temp.c_str(), "wb" );
+    if ( fp == NULL ) { return; }
+    bool ok = fwrite( &header, sizeof(header), 1, fp ) == 1 &&
+	      fwrite( binary.data(), 1, binary.size(), fp ) == binary.size();
+    ok = fclose(fp) == 0 && ok;
+    if ( !ok || rename( temp.c_str(), path.c_str() ) != 0 ) {
+	remove( temp.c_str() );
+    }
+}
+
+//----------------------------------------------------------------------------
+
+// Non-blocking program pipeline
+//
+// SubmitShader() hands both stages and the link to the driver and returns
+// at once; nothing queries GL_COMPILE_STATUS or GL_LINK_STATUS until
+// FinishShader(). Submitting every program first and finishing them
+// afterwards lets the driver overlap the work, and with
+// GL_KHR_parallel_shader_compile the compiles run on driver threads and
+// ShaderReady() can poll for completion without blocking.
+
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+typedef void (*MaxShaderCompilerThreadsProc)( GLuint count );
+
+struct PendingProgram {
+    std::string  filenames[2];
+    std::string  sources[2];
+    GLuint       shaders[2];
+    GLuint64     key;
+    bool         fromCache;
+};
+
+static std::map<GLuint, PendingProgram> pendingPrograms;
+
+static bool
+hasExtension(const char* name)
+{
+    GLint count = 0;
+    glGetIntegerv( GL_NUM_EXTENSIONS, &count );
+    for ( GLint i = 0; i < count; ++i ) {
+	const char* ext = (const char*) glGetStringi( GL_EXTENSIONS, i );
+	if ( ext != NULL && strcmp( ext, name ) == 0 ) { return true; }
+    }
+    return false;
+}
+
+bool
+ParallelShaderCompile()
+{
+    static int supported = -1;
+    if ( supported < 0 ) {
+	supported = 0;
+	const char* names[2] = { "glMaxShaderCompilerThreadsKHR", "glMaxShaderCompilerThreadsARB" };
+	const char* exts[2] = { "GL_KHR_parallel_shader_compile", "GL_ARB_parallel_shader_compile" };
+	for ( int i = 0; i < 2 && !supported; ++i ) {
+	    if ( !hasExtension( exts[i] ) ) { continue; }
+	    MaxShaderCompilerThreadsProc maxThreads =
+		(MaxShaderCompilerThreadsProc) glfwGetProcAddress( names[i] );
+	    if ( maxThreads != NULL ) {
+		maxThreads( 0xFFFFFFFFu );  // let the driver pick the thread count
+	    }
+	    supported = 1;
 	}
+    }
+    return supported == 1;
+}
 
-	GLuint shader = glCreateShader( s.type );
-	glShaderSource( shader, 1, (const GLchar**) &s.source, NULL );
-	glCompileShader( shader );
-
-	GLint  compiled;
-	glGetShaderiv( shader, GL_COMPILE_STATUS, &compiled );
-	if ( !compiled ) {
-	    std::cerr << s.filename << " failed to compile:" << std::endl;
-	    GLint  logSize;
-	    glGetShaderiv( shader, GL_INFO_LOG_LENGTH, &logSize );
-	    char* logMsg = new char[logSize];
-	    glGetShaderInfoLog( shader, logSize, NULL, logMsg );
-	    std::cerr << logMsg << std::endl;
-	    delete [] logMsg;
-
-	    exit( EXIT_FAILURE );
+// Compiles and links from source without waiting for either step
+static void
+submitSource(GLuint program, PendingProgram& p)
+{
+    const GLenum types[2] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
+    for ( int i = 0; i < 2; ++i ) {
+	const GLchar* source = p.sources[i].c_str();
+	p.shaders[i] = glCreateShader( types[i] );
+	glShaderSource( p.shaders[i], 1, &source, NULL );
+	glCompileShader( p.shaders[i] );
+	glAttachShader( program, p.shaders[i] );
+    }
+    if ( programBinarySupported() ) {
+	glProgramParameteri( program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE );
+    }
+    glLinkProgram( program );
+    p.fromCache = false;
+}
+
+// Reads both files and starts the build; returns 0 if a file is unreadable
+static GLuint
+submitProgram(const char* vShaderFile, const char* fShaderFile, const char* defines)
+{
+    ParallelShaderCompile();  // enables driver threads on first use
+
+    PendingProgram p;
+    p.filenames[0] = vShaderFile;
+    p.filenames[1] = fShaderFile;
+    p.shaders[0] = p.shaders[1] = 0;
+    for ( int i = 0; i < 2; ++i ) {
+	char* source = readShaderSource( p.filenames[i].c_str() );
+	if ( source == NULL ) {
+	    std::cerr << "Failed to read " << p.filenames[i] << std::endl;
+	    return 0;
 	}
+	p.sources[i] = injectDefines( source, defines );
+	delete [] source;
+    }
 
-	delete [] s.source;
+    GLuint program = glCreateProgram();
 
-	glAttachShader( program, shader );
+    // Warm start: reuse the driver's binary and skip GLSL compilation. Its
+    // link status is checked in FinishShader() like any other program.
+    p.key = programBinarySupported() ? programKey( p.sources[0], p.sources[1] ) : 0;
+    std::vector<char> binary;
+    GLenum format;
+    if ( p.key != 0 && readProgramBinary( p.key, format, binary ) ) {
+	glProgramBinary( program, format, binary.data(), (GLsizei) binary.size() );
+	p.fromCache = true;
+    }
+    else {
+	submitSource( program, p );
     }
 
-    /* link  and error check */
-    glLinkProgram(program);
+    pendingPrograms[program] = p;
+    return program;
+}
+
+static void registerProgram( GLuint program, const char* vShaderFile,
+			     const char* fShaderFile, const char* defines );
+
+GLuint
+SubmitShader(const char* vShaderFile, const char* fShaderFile, const char* defines)
+{
+    TRACE_ZONE("SubmitShader");
+    GLuint program = submitProgram( vShaderFile, fShaderFile, defines );
+    if ( program == 0 ) { exit( EXIT_FAILURE ); }
+    registerProgram( program, vShaderFile, fShaderFile, defines );
+    return program;
+}
+
+bool
+ShaderReady(GLuint program)
+{
+    if ( pendingPrograms.find(program) == pendingPrograms.end() ) { return true; }
+    if ( !ParallelShaderCompile() ) { return true; }  // FinishShader() will block
+
+    GLint done = GL_FALSE;
+    glGetProgramiv( program, GL_COMPLETION_STATUS_KHR, &done );
+    return done == GL_TRUE;
+}
+
+static void
+printShaderLog(GLuint shader, const std::string& filename)
+{
+    GLint  compiled;
+    glGetShaderiv( shader, GL_COMPILE_STATUS, &compiled );
+    if ( compiled ) { return; }
+
+    std::cerr << filename << " failed to compile:" << std::endl;
+    GLint  logSize;
+    glGetShaderiv( shader, GL_INFO_LOG_LENGTH, &logSize );
+    char* logMsg = new char[logSize];
+    glGetShaderInfoLog( shader, logSize, NULL, logMsg );
+    std::cerr << logMsg << std::endl;
+    delete [] logMsg;
+}
+
+// Waits for a submitted program and prints its logs on failure. A failed
+// program is deleted and false returned.
+static bool
+finishProgram(GLuint program)
+{
+    std::map<GLuint, PendingProgram>::iterator it = pendingPrograms.find(program);
+    if ( it == pendingPrograms.end() ) { return true; }
+    PendingProgram& p = it->second;
 
     GLint  linked;
     glGetProgramiv( program, GL_LINK_STATUS, &linked );
+
+    // A rejected binary (e.g. after a driver change) falls back to source
+    if ( !linked && p.fromCache ) {
+	submitSource( program, p );
+	glGetProgramiv( program, GL_LINK_STATUS, &linked );
+    }
+
     if ( !linked ) {
+	for ( int i = 0; i < 2; ++i ) {
+	    if ( p.shaders[i] != 0 ) { printShaderLog( p.shaders[i], p.filenames[i] ); }
+	}
+
 	std::cerr << "Shader program failed to link" << std::endl;
 	GLint  logSize;
 	glGetProgramiv( program, GL_INFO_LOG_LENGTH, &logSize);
@@ -85,8 +388,253 @@ InitShader(const char* vShaderFile, const char* fShaderFile)
 	std::cerr << logMsg << std::endl;
 	delete [] logMsg;
 
-	exit( EXIT_FAILURE );
+	for ( int i = 0; i < 2; ++i ) {
+	    if ( p.shaders[i] != 0 ) { glDeleteShader( p.shaders[i] ); }
+	}
+	pendingPrograms.erase(it);
+	glDeleteProgram( program );
+	return false;
+    }
+
+    if ( !p.fromCache && p.key != 0 ) {
+	saveProgramBinary( program, p.key );
     }
+    for ( int i = 0; i < 2; ++i ) {
+	if ( p.shaders[i] != 0 ) {
+	    glDetachShader( program, p.shaders[i] );
+	    glDeleteShader( p.shaders[i] );
+	}
+    }
+    pendingPrograms.erase(it);
+    return true;
+}
+
+void
+FinishShader(GLuint program)
+{
+    TRACE_ZONE("FinishShader");
+    if ( !finishProgram( program ) ) { exit( EXIT_FAILURE ); }
+}
+
+//----------------------------------------------------------------------------
+
+// Shader hot reload
+//
+// Every program built from files is remembered together with its defines.
+// WatchShaders() starts a thread that watches those files (inotify on Linux,
+// modification times elsewhere) and only records which ones changed; all GL
+// work happens in ReloadShaders(), called once per frame on the GL thread.
+// A replacement is submitted like any other program and swapped in as a
+// whole once it has linked, so a frame never sees a half-built program. If
+// it fails, the log is printed and the old program stays in use.
+
+struct ProgramSource {
+    std::string  filenames[2];
+    std::string  defines;
+    bool         dirty;
+};
+
+static std::map<GLuint, ProgramSource> programSources;
+static std::map<GLuint, GLuint> reloadingPrograms;  // replacement -> original
+
+static std::mutex watchMutex;
+static std::set<std::string> watchedFiles;   // guarded by watchMutex
+static std::set<std::string> changedFiles;   // guarded by watchMutex
+static std::thread watcherThread;
+static std::atomic<bool> stopWatcher( false );
+
+#ifdef __linux__
+static int inotifyFd = -1;
+static std::map<int, std::string> watchedDirs;  // guarded by watchMutex
+#else
+static std::map<std::string, time_t> watchedTimes;  // guarded by watchMutex
+#endif
+
+// "dir/name" for a file, so names reported relative to a directory match
+static std::string
+watchKey(const std::string& filename, std::string* dir = NULL)
+{
+    size_t slash = filename.find_last_of("/\\");
+    std::string d = (slash == std::string::npos) ? "." : filename.substr(0, slash);
+    if ( dir != NULL ) { *dir = d; }
+    return d + "/" + filename.substr(slash == std::string::npos ? 0 : slash + 1);
+}
+
+// Caller holds watchMutex
+static void
+watchFile(const std::string& filename)
+{
+    std::string dir;
+    std::string key = watchKey( filename, &dir );
+    if ( !watchedFiles.insert(key).second ) { return; }
+#ifdef __linux__
+    if ( inotifyFd < 0 ) { return; }
+    for ( std::map<int, std::string>::iterator it = watchedDirs.begin(); it != watchedDirs.end(); ++it ) {
+	if ( it->second == dir ) { return; }
+    }
+    // Editors either rewrite the file or rename a new one over it
+    int wd = inotify_add_watch( inotifyFd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO );
+    if ( wd >= 0 ) { watchedDirs[wd] = dir; }
+#else
+    struct stat st;
+    watchedTimes[key] = stat( filename.c_str(), &st ) == 0 ? st.st_mtime : 0;
+#endif
+}
+
+static void
+registerProgram(GLuint program, const char* vShaderFile, const char* fShaderFile,
+		const char* defines)
+{
+    ProgramSource& source = programSources[program];
+    source.filenames[0] = vShaderFile;
+    source.filenames[1] = fShaderFile;
+    source.defines = defines != NULL ? defines : "";
+    source.dirty = false;
+
+    std::lock_guard<std::mutex> lock( watchMutex );
+    watchFile( source.filenames[0] );
+    watchFile( source.filenames[1] );
+}
+
+static void
+watchLoop()
+{
+#ifdef __linux__
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while ( !stopWatcher ) {
+	struct pollfd pfd = { inotifyFd, POLLIN, 0 };
+	if ( poll( &pfd, 1, 200 ) <= 0 ) { continue; }
+	ssize_t length = read( inotifyFd, buffer, sizeof(buffer) );
+	std::lock_guard<std::mutex> lock( watchMutex );
+	for ( ssize_t offset = 0; offset < length; ) {
+	    const struct inotify_event* event = (const struct inotify_event*) (buffer + offset);
+	    offset += sizeof(struct inotify_event) + event->len;
+	    std::map<int, std::string>::iterator dir = watchedDirs.find( event->wd );
+	    if ( event->len == 0 || dir == watchedDirs.end() ) { continue; }
+	    std::string key = dir->second + "/" + event->name;
+	    if ( watchedFiles.count(key) ) { changedFiles.insert(key); }
+	}
+    }
+#else
+    while ( !stopWatcher ) {
+	std::this_thread::sleep_for( std::chrono::milliseconds(200) );
+	std::lock_guard<std::mutex> lock( watchMutex );
+	for ( std::map<std::string, time_t>::iterator it = watchedTimes.begin(); it != watchedTimes.end(); ++it ) {
+	    struct stat st;
+	    if ( stat( it->first.c_str(), &st ) == 0 && st.st_mtime != it->second ) {
+		it->second = st.st_mtime;
+		changedFiles.insert( it->first );
+	    }
+	}
+    }
+#endif
+}
+
+static void
+stopWatching()
+{
+    stopWatcher = true;
+    if ( watcherThread.joinable() ) { watcherThread.join(); }
+#ifdef __linux__
+    if ( inotifyFd >= 0 ) { close( inotifyFd ); }
+#endif
+}
+
+void
+WatchShaders()
+{
+    if ( watcherThread.joinable() ) { return; }
+
+    {
+	std::lock_guard<std::mutex> lock( watchMutex );
+	std::set<std::string> files;
+	files.swap( watchedFiles );
+#ifdef __linux__
+	inotifyFd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+	if ( inotifyFd < 0 ) {
+	    std::cerr << "inotify unavailable, shader hot reload disabled" << std::endl;
+	    watchedFiles.swap( files );
+	    return;
+	}
+#endif
+	for ( std::set<std::string>::iterator it = files.begin(); it != files.end(); ++it ) {
+	    watchFile( *it );
+	}
+    }
+
+    watcherThread = std::thread( watchLoop );
+    atexit( stopWatching );
+}
+
+int
+ReloadShaders(ShaderReloadCallback callback)
+{
+    std::set<std::string> changed;
+    {
+	std::lock_guard<std::mutex> lock( watchMutex );
+	changed.swap( changedFiles );
+    }
+
+    for ( std::map<GLuint, ProgramSource>::iterator it = programSources.begin(); it != programSources.end(); ++it ) {
+	for ( int i = 0; i < 2; ++i ) {
+	    if ( changed.count( watchKey( it->second.filenames[i] ) ) ) { it->second.dirty = true; }
+	}
+    }
+
+    // Start one rebuild per dirty program. Programs that are still being
+    // built, or already being replaced, pick the change up afterwards; a
+    // program whose files cannot be read right now stays dirty and is
+    // retried next frame.
+    std::set<GLuint> replacing;
+    for ( std::map<GLuint, GLuint>::iterator it = reloadingPrograms.begin(); it != reloadingPrograms.end(); ++it ) {
+	replacing.insert( it->second );
+    }
+    for ( std::map<GLuint, ProgramSource>::iterator it = programSources.begin(); it != programSources.end(); ++it ) {
+	ProgramSource& source = it->second;
+	if ( !source.dirty || replacing.count( it->first ) || pendingPrograms.count( it->first ) ) { continue; }
+	GLuint program = submitProgram( source.filenames[0].c_str(), source.filenames[1].c_str(),
+					source.defines.c_str() );
+	if ( program != 0 ) {
+	    source.dirty = false;
+	    reloadingPrograms[program] = it->first;
+	}
+    }
+
+    // Swap in every replacement the driver has finished
+    int swapped = 0;
+    for ( std::map<GLuint, GLuint>::iterator it = reloadingPrograms.begin(); it != reloadingPrograms.end(); ) {
+	GLuint program = it->first;
+	GLuint original = it->second;
+	if ( !ShaderReady( program ) ) { ++it; continue; }
+	reloadingPrograms.erase( it++ );
+
+	ProgramSource& source = programSources[original];
+	if ( !finishProgram( program ) ) {
+	    std::cerr << "Keeping the previous build of " << source.filenames[0] << " + "
+		      << source.filenames[1] << std::endl;
+	    continue;
+	}
+
+	GLint current = 0;
+	glGetIntegerv( GL_CURRENT_PROGRAM, &current );
+	if ( (GLuint) current == original ) { glUseProgram( program ); }
+	if ( callback != NULL ) { callback( original, program ); }
+
+	programSources[program] = source;
+	programSources.erase( original );
+	glDeleteProgram( original );
+	++swapped;
+    }
+    return swapped;
+}
+
+// Same, with preprocessor definitions prepended to both stages
+GLuint
+InitShader(const char* vShaderFile, const char* fShaderFile, const char* defines)
+{
+    TRACE_ZONE("InitShader");
+    GLuint program = SubmitShader( vShaderFile, fShaderFile, defines );
+    FinishShader( program );
 
     /* use program object */
     glUseProgram(program);
@@ -0,0 +1,38 @@
+#ifndef INIT_SHADER_H
+#define INIT_SHADER_H
+
+// Extensions to Angel::InitShader() (Angel.h declares the two-file version)
+
+namespace Angel {
+
+// Builds a program from vertex and fragment shader files, inserting
+// 'defines' (e.g. "#define TEXTURED 1\n") after the #version line of both
+GLuint InitShader( const char* vShaderFile, const char* fShaderFile, const char* defines );
+
+// Non-blocking builds: submit every program first, then finish them.
+// SubmitShader() returns a program whose compile and link may still be in
+// flight; FinishShader() waits for it and reports errors the same way
+// InitShader() does. Programs must be finished before they are used.
+GLuint SubmitShader( const char* vShaderFile, const char* fShaderFile, const char* defines );
+void   FinishShader( GLuint program );
+
+// True when a submitted program can be finished without blocking. Always
+// true without GL_KHR_parallel_shader_compile.
+bool   ShaderReady( GLuint program );
+
+// Whether the driver compiles on its own threads
+bool   ParallelShaderCompile();
+
+// Hot reload. WatchShaders() starts watching the files of every program
+// built so far or later. ReloadShaders(), called once per frame, rebuilds
+// the programs whose files changed and, for each one that links, makes the
+// replacement current if the original was, calls 'callback' so uniforms
+// can be set up again, and deletes the original. A failed rebuild only
+// prints its log. Returns the number of programs replaced.
+typedef void (*ShaderReloadCallback)( GLuint oldProgram, GLuint newProgram );
+void   WatchShaders();
+int    ReloadShaders( ShaderReloadCallback callback );
+
+}  // Close namespace Angel block
+
+#endif
@@ -3,6 +3,8 @@
 //
 
 #include "Angel.h"
+#include "FrameTimers.h"
+#include "TraceProfiler.h"
 #include <vector>
 
 const int NumSegments = 100; // Number of segments to approximate the circle
@@ -47,6 +49,12 @@ const vec4 blueColor = vec4(0.0, 0.0, 1.0, 1.0);
 GLuint ModelView, Projection;
 GLuint program;  // Shader program
 
+// Timed phases of a frame (F1 shows the timings, F2 saves them)
+enum { PhaseUpdate, PhaseTrajectory, PhaseShape };
+FrameTimers frameTimers({ "update", "trajectory", "shape" });
+const char* frameTimesFile = "frame_times.csv";
+const char* traceFile = "trace.json";  // F3; TRACE_FILE=<file> traces the whole run
+
 //----------------------------------------------------------------------------
 
 // Update colors based on current color selection
@@ -179,6 +187,7 @@ void resetPosition()
 // Update the circle position for bouncing
 void update()
 {
+    TRACE_ZONE("update");
     // Apply gravity to vertical velocity
     velocity.y -= gravity;
     
@@ -236,6 +245,7 @@ void update()
 // Draw trajectory points as dots
 void draw_trajectory()
 {
+    TRACE_ZONE("draw_trajectory");
     if (!showTrajectory || trajectoryPoints.empty()) {
         return;
     }
@@ -293,10 +303,15 @@ void draw_trajectory()
 
 void display(void)
 {
+    TRACE_ZONE("display");
     glClear(GL_COLOR_BUFFER_BIT);
     
     // Draw trajectory first
+    frameTimers.beginPhase(PhaseTrajectory);
     draw_trajectory();
+    frameTimers.endPhase(PhaseTrajectory);
+    
+    frameTimers.beginPhase(PhaseShape);
     
     // Update buffer with shape data again (as draw_trajectory changes it)
     glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(points), points);
@@ -323,7 +338,9 @@ void display(void)
             glDrawArrays(GL_LINE_LOOP, 0, 6);
         }
     }
+    frameTimers.endPhase(PhaseShape);
     
+    frameTimers.drawOverlay();
     glFinish();
 }
 
@@ -338,6 +355,9 @@ void print_help() {
     printf("T: Toggle trajectory display on/off\n");
     printf("Left Mouse Button: Toggle filled/outline shape\n");
     printf("Right Mouse Button: Toggle between circle/square\n");
+    printf("F1: Show/hide frame timings (p50/p95/p99 frame, CPU and GPU times)\n");
+    printf("F2: Save frame timings to %s\n", frameTimesFile);
+    printf("F3: Start/stop a Chrome trace (written to %s)\n", traceFile);
     printf("H: Display this help message\n");
     printf("-----------------------------\n\n");
 }
@@ -365,6 +385,15 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
                 // Display help information
                 print_help();
                 break;
+            case GLFW_KEY_F1:
+                frameTimers.toggleOverlay();
+                break;
+            case GLFW_KEY_F2:
+                frameTimers.writeCsv(frameTimesFile);
+                break;
+            case GLFW_KEY_F3:
+                TraceProfiler::toggle(traceFile);
+                break;
         }
     }
 }
@@ -388,6 +417,9 @@ void mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
 
 int main()
 {
+    TraceProfiler::startFromEnvironment();
+    TraceProfiler::nameThread("main");
+    
     if (!glfwInit())
         exit(EXIT_FAILURE);
     
@@ -417,15 +449,18 @@ int main()
     double frameRate = 120, currentTime, previousTime = 0.0;
     
     while (!glfwWindowShouldClose(window)) {
+        frameTimers.beginFrame();
         glfwPollEvents();
         
         currentTime = glfwGetTime();
         if (currentTime - previousTime >= 1/frameRate) {
             previousTime = currentTime;
+            TimedPhase timed(frameTimers, PhaseUpdate, false);
             update();
         }
         
         display();
+        frameTimers.endFrame();
         glfwSwapBuffers(window);
     }
     
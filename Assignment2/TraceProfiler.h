@@ -0,0 +1,296 @@
+//
+//  Scoped profiling zones written as a Chrome trace
+//
+//  TRACE_ZONE("name") at the top of a block records the block's start and
+//  duration while a trace is recording. The trace is saved in the Chrome
+//  trace-event JSON format (one complete "X" event per zone, one track per
+//  thread), which chrome://tracing, Perfetto and Speedscope open directly.
+//
+//  Every thread appends to its own buffer, a list of fixed-size chunks
+//  that only that thread writes. An event is made visible by a release
+//  store of the chunk's count, so write() can read every thread's events
+//  while they keep recording, with no lock on either side. Buffers are
+//  linked into one global list on first use with a compare-and-swap and are
+//  never freed; a thread that exits hands its buffer, and so its track, to
+//  the next new thread, so short-lived threads do not pile up buffers.
+//
+//  Each start() begins a new session. A buffer is tagged with the session
+//  it holds events of, and its owner rewinds it (keeping the chunks) the
+//  first time it records in a newer one, so every trace gets the full
+//  per-thread capacity; write() skips buffers still holding an older
+//  session. write() and start() are only called from one thread.
+//
+//  A zone that is compiled in costs one relaxed atomic load and a branch
+//  while no trace is recording. Defining NO_TRACE_ZONES removes them all.
+//  Names must be string literals (only the pointer is stored).
+//
+
+#ifndef TRACE_PROFILER_H
+#define TRACE_PROFILER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+class TraceProfiler {
+public:
+    static const size_t ChunkEvents = 1024;
+    static const size_t MaxChunksPerThread = 1024;  // about 24 MB of events per thread
+
+    static bool recording() { return recordingFlag().load(std::memory_order_relaxed); }
+
+    // Starts a trace; only zones that begin from now on are written
+    static void start() {
+        state().sessionStart.store(now(), std::memory_order_relaxed);
+        state().session.fetch_add(1, std::memory_order_release);  // after the last write() of the old one
+        recordingFlag().store(true, std::memory_order_relaxed);
+    }
+
+    static void stop() { recordingFlag().store(false, std::memory_order_relaxed); }
+
+    // Starts a trace, or stops it and writes it to 'filename'
+    static void toggle(const char* filename) {
+        if (recording()) {
+            stop();
+            write(filename);
+        } else {
+            start();
+            std::cout << "Recording a trace" << std::endl;
+        }
+    }
+
+    // With TRACE_FILE set in the environment, records the whole session
+    // and writes it to that file when the program exits
+    static void startFromEnvironment() {
+        const char* filename = getenv("TRACE_FILE");
+        if (filename == NULL || *filename == '\0') {
+            return;
+        }
+        state().exitFilename = filename;
+        start();
+        atexit([] {
+            if (recording()) {
+                stop();
+                write(state().exitFilename.c_str());
+            }
+        });
+    }
+
+    // Names the calling thread's track ('name' must outlive the trace)
+    static void nameThread(const char* name) {
+        threadBuffer()->name.store(name, std::memory_order_relaxed);
+    }
+
+    // Writes every event of the current (or last) trace recorded so far
+    static bool write(const char* filename) {
+        FILE* file = fopen(filename, "w");
+        if (file == NULL) {
+            std::cerr << "Cannot write trace to " << filename << std::endl;
+            return false;
+        }
+        int64_t sessionStart = state().sessionStart.load(std::memory_order_relaxed);
+        uint32_t session = state().session.load(std::memory_order_relaxed);
+        size_t events = 0;
+        uint64_t dropped = 0;
+        fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        const char* separator = "";
+        for (ThreadBuffer* buffer = state().threads.load(std::memory_order_acquire); buffer != NULL;
+             buffer = buffer->next) {
+            if (buffer->session.load(std::memory_order_acquire) != session) continue;
+            const char* name = buffer->name.load(std::memory_order_relaxed);
+            if (name != NULL) {
+                fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":",
+                        separator, buffer->id);
+                writeString(file, name);
+                fprintf(file, "}}");
+                separator = ",\n";
+            }
+            for (Chunk* chunk = buffer->first; chunk != NULL; chunk = chunk->next.load(std::memory_order_acquire)) {
+                size_t count = chunk->count.load(std::memory_order_acquire);
+                for (size_t i = 0; i < count; i++) {
+                    const Event& event = chunk->events[i];
+                    if (event.start < sessionStart) continue;
+                    fprintf(file, "%s{\"name\":", separator);
+                    writeString(file, event.name);
+                    fprintf(file, ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", buffer->id,
+                            (event.start - sessionStart) * 1e-3, event.duration * 1e-3);
+                    separator = ",\n";
+                    events++;
+                }
+            }
+            dropped += buffer->dropped.load(std::memory_order_relaxed);
+        }
+        fprintf(file, "\n]}\n");
+        bool written = fclose(file) == 0;
+        if (written) {
+            std::cout << "Wrote " << events << " trace events to " << filename;
+            if (dropped > 0) {
+                std::cout << " (" << dropped << " dropped, buffers full)";
+            }
+            std::cout << std::endl;
+        }
+        return written;
+    }
+
+    // Nanoseconds on the steady clock
+    static int64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Appends a finished zone to the calling thread's buffer
+    static void record(const char* name, int64_t start, int64_t duration) {
+        ThreadBuffer* buffer = threadBuffer();
+        uint32_t session = state().session.load(std::memory_order_acquire);
+        if (buffer->session.load(std::memory_order_relaxed) != session) {
+            rewind(buffer, session);
+        }
+        Chunk* chunk = buffer->last;
+        size_t count = chunk->count.load(std::memory_order_relaxed);
+        if (count == ChunkEvents) {
+            if (buffer->chunks == MaxChunksPerThread) {
+                buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            Chunk* next = chunk->next.load(std::memory_order_relaxed);  // kept from an earlier session
+            if (next == NULL) {
+                next = new Chunk();
+                chunk->next.store(next, std::memory_order_release);
+            }
+            buffer->last = chunk = next;
+            buffer->chunks++;
+            count = 0;
+        }
+        chunk->events[count] = { name, start, duration };
+        chunk->count.store(count + 1, std::memory_order_release);
+    }
+
+private:
+    struct Event {
+        const char* name;
+        int64_t start, duration;
+    };
+
+    struct Chunk {
+        Event events[ChunkEvents];
+        std::atomic<size_t> count{0};
+        std::atomic<Chunk*> next{NULL};
+    };
+
+    struct ThreadBuffer {
+        uint32_t id = 0;
+        std::atomic<bool> owned{true};
+        std::atomic<uint32_t> session{0};   // whose events the chunks hold
+        std::atomic<const char*> name{NULL};
+        std::atomic<uint64_t> dropped{0};
+        Chunk* first = NULL;
+        Chunk* last = NULL;   // owner only
+        size_t chunks = 1;    // owner only
+        ThreadBuffer* next = NULL;  // set before the buffer is published
+    };
+
+    struct State {
+        std::atomic<ThreadBuffer*> threads{NULL};
+        std::atomic<uint32_t> nextThreadId{1};
+        std::atomic<uint32_t> session{0};
+        std::atomic<int64_t> sessionStart{0};
+        std::string exitFilename;
+    };
+
+    // Constant-initialized, so checking it needs no static guard
+    static std::atomic<bool>& recordingFlag() {
+        static std::atomic<bool> flag(false);
+        return flag;
+    }
+
+    static State& state() {
+        static State s;
+        return s;
+    }
+
+    // Gives up the thread's buffer when the thread exits
+    struct ThreadSlot {
+        ThreadBuffer* buffer = NULL;
+        ~ThreadSlot() {
+            if (buffer != NULL) {
+                buffer->owned.store(false, std::memory_order_release);
+            }
+        }
+    };
+
+    // The calling thread's buffer: a free one if another thread has exited,
+    // otherwise a new one pushed onto the list
+    static ThreadBuffer* threadBuffer() {
+        static thread_local ThreadSlot slot;
+        if (slot.buffer != NULL) {
+            return slot.buffer;
+        }
+        State& s = state();
+        for (ThreadBuffer* buffer = s.threads.load(std::memory_order_acquire); buffer != NULL; buffer = buffer->next) {
+            bool owned = false;
+            if (buffer->owned.compare_exchange_strong(owned, true, std::memory_order_acquire)) {
+                return slot.buffer = buffer;
+            }
+        }
+        ThreadBuffer* buffer = new ThreadBuffer();
+        buffer->id = s.nextThreadId.fetch_add(1, std::memory_order_relaxed);
+        buffer->first = buffer->last = new Chunk();
+        buffer->next = s.threads.load(std::memory_order_relaxed);
+        while (!s.threads.compare_exchange_weak(buffer->next, buffer, std::memory_order_release,
+                                                std::memory_order_relaxed)) {
+        }
+        return slot.buffer = buffer;
+    }
+
+    // Empties the owner's buffer for 'session'. The new tag is published
+    // last, so write() never reads a chunk while it is being emptied.
+    static void rewind(ThreadBuffer* buffer, uint32_t session) {
+        for (Chunk* chunk = buffer->first; chunk != NULL; chunk = chunk->next.load(std::memory_order_relaxed)) {
+            chunk->count.store(0, std::memory_order_relaxed);
+        }
+        buffer->last = buffer->first;
+        buffer->chunks = 1;
+        buffer->dropped.store(0, std::memory_order_relaxed);
+        buffer->session.store(session, std::memory_order_release);
+    }
+
+    static void writeString(FILE* file, const char* text) {
+        fputc('"', file);
+        for (const char* c = text; *c != '\0'; c++) {
+            if (*c == '"' || *c == '\\') fputc('\\', file);
+            fputc(*c, file);
+        }
+        fputc('"', file);
+    }
+};
+
+// Records the enclosing block as one zone while a trace is recording
+class TraceZone {
+public:
+    explicit TraceZone(const char* name)
+        : name(name), start(TraceProfiler::recording() ? TraceProfiler::now() : -1) {}
+
+    ~TraceZone() {
+        if (start >= 0) {
+            TraceProfiler::record(name, start, TraceProfiler::now() - start);
+        }
+    }
+
+private:
+    const char* name;
+    int64_t start;
+};
+
+#ifdef NO_TRACE_ZONES
+#define TRACE_ZONE(name) ((void)0)
+#else
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_ZONE(name) TraceZone TRACE_CONCAT(traceZone, __LINE__)(name)
+#endif
+
+#endif
@@ -3,6 +3,8 @@
 //
 
 #include "Angel.h"
+#include "FrameTimers.h"
+#include "TraceProfiler.h"
 #include <vector>
 #include <cstdlib>  // For rand() and srand()
 #include <ctime>    // For time()
@@ -76,6 +78,12 @@ GLuint vao;
 GLuint buffer;
 GLuint program;
 
+// Timed phases of a frame (F1 shows the timings, F2 saves them)
+enum { PhaseUpdate, PhaseCubes };
+FrameTimers frameTimers({ "update", "cubes" });
+const char* frameTimesFile = "frame_times.csv";
+const char* traceFile = "trace.json";  // F3; TRACE_FILE=<file> traces the whole run
+
 // Structure to store a single subcube
 struct Subcube {
     int x, y, z;          // Grid position (0-2)
@@ -236,6 +244,7 @@ void initializeSubcubes() {
 
 // Draw a single subcube
 void drawSubcube(Subcube &cube) {
+    TRACE_ZONE("drawSubcube");
     if (!cube.drawn) return;
     
     // Upload vertex and color data for this cube
@@ -298,6 +307,7 @@ void startScrambling(int moves) {
 // Update function to handle cube animations
 void update(void)
 {
+    TRACE_ZONE("update");
     if (isRotating) {
         // Increment rotation
         rotationAngle += rotationIncrement * rotationDirection;
@@ -432,6 +442,7 @@ void init()
 
 void display(void)
 {
+    TRACE_ZONE("display");
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     
     // Position the camera slightly back to see the entire cube
@@ -444,10 +455,13 @@ void display(void)
     glUniformMatrix4fv(ModelView, 1, GL_TRUE, model_view);
     
     // Draw each subcube individually
+    frameTimers.beginPhase(PhaseCubes);
     for (int i = 0; i < NumCubes; i++) {
         drawSubcube(subcubes[i]);
     }
+    frameTimers.endPhase(PhaseCubes);
     
+    frameTimers.drawOverlay();
     glFinish();
 }
 
@@ -460,6 +474,9 @@ void displayHelp() {
     std::cout << "  h: Display this help message\n";
     std::cout << "  q/ESC: Quit the application\n";
     std::cout << "  s: Scramble the cube (20 random moves)\n";
+    std::cout << "  F1: Show/hide frame timings (p50/p95/p99 frame, CPU and GPU times)\n";
+    std::cout << "  F2: Save frame timings to " << frameTimesFile << "\n";
+    std::cout << "  F3: Start/stop a Chrome trace (written to " << traceFile << ")\n";
     std::cout << "\nSlice Rotation Controls:\n";
     std::cout << "  X-axis rotations (Front/Middle/Back):\n";
     std::cout << "    f/c: Front slice clockwise/counter-clockwise\n";
@@ -498,6 +515,19 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
             startScrambling(20);
             break;
             
+        // Frame timings: F1 shows them, F2 saves them
+        case GLFW_KEY_F1:
+            if (action == GLFW_PRESS) frameTimers.toggleOverlay();
+            break;
+        case GLFW_KEY_F2:
+            if (action == GLFW_PRESS) frameTimers.writeCsv(frameTimesFile);
+            break;
+            
+        // Chrome trace of update/display/drawSubcube with F3
+        case GLFW_KEY_F3:
+            if (action == GLFW_PRESS) TraceProfiler::toggle(traceFile);
+            break;
+            
         // X-axis rotations (Front/middle/back slices)
         case GLFW_KEY_F: // Front slice clockwise
             startSliceRotation(Xaxis, 0, 1);
@@ -602,6 +632,9 @@ void cursor_position_callback(GLFWwindow* window, double xpos, double ypos)
 
 int main()
 {
+    TraceProfiler::startFromEnvironment();
+    TraceProfiler::nameThread("main");
+    
     // Seed random number generator
     srand(static_cast<unsigned int>(time(nullptr)));
     
@@ -632,14 +665,17 @@ int main()
     double frameRate = 120, currentTime, previousTime = 0.0;
     while (!glfwWindowShouldClose(window))
     {
+        frameTimers.beginFrame();
         glfwPollEvents();
         currentTime = glfwGetTime();
         if (currentTime - previousTime >= 1/frameRate){
             previousTime = currentTime;
+            TimedPhase timed(frameTimers, PhaseUpdate, false);
             update();
         }
         
         display();
+        frameTimers.endFrame();
         glfwSwapBuffers(window);
     }
     
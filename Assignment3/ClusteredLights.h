@@ -0,0 +1,213 @@
+//
+//  Clustered light assignment
+//
+//  The view volume is cut into clusters: screen tiles of a fixed pixel size,
+//  each split into depth slices. Every frame each point light is listed in
+//  the clusters its sphere of influence touches, and the fragment shader
+//  loops over the lights of its own cluster only, so shading cost follows
+//  the local light density instead of the total light count.
+//
+//  The projection is orthographic, so a cluster is a box in eye coordinates
+//  and a light is tested against it exactly (sphere against box).
+//
+//  Binning is split across threads by bands of tile rows. Each band walks
+//  every light, clips the light's footprint to its own rows and writes only
+//  its own clusters, so the bands never share a list and need no locks. The
+//  bands' lists are then joined into one compact index list. The output is
+//  ready for texture buffers: an (offset, count) pair per cluster into the
+//  index list, and the index list of 16-bit light numbers. Nothing here
+//  touches OpenGL.
+//
+
+#ifndef CLUSTERED_LIGHTS_H
+#define CLUSTERED_LIGHTS_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Layout matches two RGBA32F texels of the PointLights texture buffer
+struct PointLight {
+    float x, y, z;   // eye coordinates
+    float range;     // no light beyond this distance
+    float red, green, blue;
+    float padding;
+};
+
+// Cluster (x, y, slice) covers eye x from left + x * tileWidth, y from
+// bottom + y * tileHeight and z from zMin + slice * sliceDepth
+struct ClusterGrid {
+    int tilesX, tilesY, slices;
+    float left, bottom, tileWidth, tileHeight;
+    float zMin, sliceDepth;
+
+    int clusterCount() const { return tilesX * tilesY * slices; }
+    // Clusters of one tile row are contiguous, so a band of rows is too
+    int clusterIndex(int x, int y, int slice) const { return (y * tilesX + x) * slices + slice; }
+};
+
+class LightClusters {
+public:
+    static const size_t MaxLights = 65535;  // 16-bit light numbers
+
+    // 'threads' = 0 uses every hardware thread; the caller is one of them
+    explicit LightClusters(unsigned threads = 0) {
+        if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        bands.resize(threads);
+        for (unsigned t = 1; t < threads; t++) workers.emplace_back(&LightClusters::work, this, t);
+    }
+
+    ~LightClusters() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers) worker.join();
+    }
+
+    // Lists the first MaxLights of 'lights' in every cluster of 'grid' they reach
+    void assign(const ClusterGrid& grid, const std::vector<PointLight>& lights) {
+        currentGrid = grid;
+        currentLights = &lights;
+        clusterRanges.assign(size_t(grid.clusterCount()) * 2, 0);
+
+        int bandCount = std::max(1, std::min(int(bands.size()), grid.tilesY));
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            activeBands = bandCount;
+            remaining = bandCount - 1;
+            generation++;
+        }
+        if (bandCount > 1) wake.notify_all();
+        binBand(0);
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait(lock, [this] { return remaining == 0; });
+        }
+
+        // Join the bands: their clusters are already in order
+        size_t total = 0;
+        for (int b = 0; b < bandCount; b++) total += bands[b].indices.size();
+        indices.resize(total);
+        uint32_t base = 0;
+        for (int b = 0; b < bandCount; b++) {
+            const Band& band = bands[b];
+            std::copy(band.indices.begin(), band.indices.end(), indices.begin() + base);
+            for (int c = band.firstCluster; c < band.endCluster; c++) clusterRanges[2 * c] += base;
+            base += uint32_t(band.indices.size());
+        }
+    }
+
+    // (offset into lightIndices(), count) for every cluster
+    const std::vector<uint32_t>& ranges() const { return clusterRanges; }
+    const std::vector<uint16_t>& lightIndices() const { return indices; }
+
+private:
+    struct Band {
+        int firstCluster = 0, endCluster = 0;
+        std::vector<uint64_t> pairs;  // cluster (relative to the band) << 16 | light
+        std::vector<uint32_t> counts;
+        std::vector<uint16_t> indices;
+    };
+
+    void work(unsigned band) {
+        unsigned seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+                if (int(band) >= activeBands) continue;
+            }
+            binBand(band);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--remaining == 0) done.notify_one();
+        }
+    }
+
+    // Bins every light into the clusters of band 'b'
+    void binBand(int b) {
+        const ClusterGrid& g = currentGrid;
+        const std::vector<PointLight>& lights = *currentLights;
+        int bandCount = activeBands;
+        int firstRow = int(int64_t(g.tilesY) * b / bandCount);
+        int endRow = int(int64_t(g.tilesY) * (b + 1) / bandCount);
+
+        Band& band = bands[b];
+        band.firstCluster = g.clusterIndex(0, firstRow, 0);
+        band.endCluster = g.clusterIndex(0, endRow, 0);
+        band.pairs.clear();
+
+        size_t lightCount = std::min(lights.size(), size_t(MaxLights));
+        for (size_t i = 0; i < lightCount; i++) {
+            const PointLight& light = lights[i];
+            int x0, x1, y0, y1, z0, z1;
+            if (!cellRange(light.x, light.range, g.left, g.tileWidth, g.tilesX, x0, x1) ||
+                !cellRange(light.y, light.range, g.bottom, g.tileHeight, endRow, y0, y1) ||
+                !cellRange(light.z, light.range, g.zMin, g.sliceDepth, g.slices, z0, z1)) {
+                continue;
+            }
+            y0 = std::max(y0, firstRow);
+            float range2 = light.range * light.range;
+            for (int y = y0; y <= y1; y++) {
+                float dy = axisDistance(light.y, g.bottom + y * g.tileHeight, g.tileHeight);
+                for (int x = x0; x <= x1; x++) {
+                    float dx = axisDistance(light.x, g.left + x * g.tileWidth, g.tileWidth);
+                    for (int z = z0; z <= z1; z++) {
+                        float dz = axisDistance(light.z, g.zMin + z * g.sliceDepth, g.sliceDepth);
+                        if (dx * dx + dy * dy + dz * dz > range2) continue;
+                        band.pairs.push_back(uint64_t(g.clusterIndex(x, y, z) - band.firstCluster) << 16 | i);
+                    }
+                }
+            }
+        }
+
+        // Counting sort by cluster; lights stay in ascending order within each
+        size_t clusters = size_t(band.endCluster - band.firstCluster);
+        band.counts.assign(clusters + 1, 0);
+        for (uint64_t pair : band.pairs) band.counts[(pair >> 16) + 1]++;
+        for (size_t c = 0; c < clusters; c++) {
+            clusterRanges[2 * (band.firstCluster + c)] = band.counts[c];
+            clusterRanges[2 * (band.firstCluster + c) + 1] = band.counts[c + 1];
+            band.counts[c + 1] += band.counts[c];
+        }
+        band.indices.resize(band.pairs.size());
+        for (uint64_t pair : band.pairs) band.indices[band.counts[pair >> 16]++] = uint16_t(pair & 0xFFFF);
+    }
+
+    // Cells [first, last] of size 'cell' starting at 'origin' that the
+    // interval centre +- radius overlaps; false if none of 'count' does
+    static bool cellRange(float centre, float radius, float origin, float cell, int count, int& first, int& last) {
+        float low = (centre - radius - origin) / cell;
+        float high = (centre + radius - origin) / cell;
+        if (high < 0.0f || low >= float(count)) return false;
+        first = std::max(int(low), 0);
+        last = std::min(int(high), count - 1);
+        return true;
+    }
+
+    // Distance from 'p' to the interval [start, start + size]
+    static float axisDistance(float p, float start, float size) {
+        return std::max(std::max(start - p, p - start - size), 0.0f);
+    }
+
+    ClusterGrid currentGrid = {};
+    const std::vector<PointLight>* currentLights = NULL;
+    std::vector<uint32_t> clusterRanges;
+    std::vector<uint16_t> indices;
+    std::vector<Band> bands;
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    unsigned generation = 0;
+    int activeBands = 0, remaining = 0;
+    bool stopping = false;
+};
+
+#endif
@@ -0,0 +1,101 @@
+//
+//  Frustum culling of bounding spheres
+//
+//  The six planes of the view volume come from the projection times
+//  modelview matrix (Gribb and Hartmann) and are normalized, so a plane's
+//  value at a point is the signed distance to it. A sphere is outside when
+//  its centre is further than its radius behind any plane.
+//
+//  Centres are read straight from the simulation's structure of arrays and
+//  interpolated between the last two steps on the fly, four spheres at a
+//  time with SSE2 (scalar elsewhere). Every sphere lies in the z = 0 plane,
+//  so a plane costs two multiply-adds per sphere.
+//
+
+#ifndef FRUSTUM_CULLING_H
+#define FRUSTUM_CULLING_H
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FRUSTUM_CULLING_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// Planes a x + b y + c z + d = 0 with unit normals pointing inwards, one
+// array per coefficient
+struct ViewFrustum {
+    float a[6], b[6], c[6], d[6];
+};
+
+// 'm' is row-major with clip = m * point, like Angel's mat4
+inline ViewFrustum frustumFromMatrix(const float m[16]) {
+    ViewFrustum f;
+    for (int p = 0; p < 6; p++) {
+        // left/right, bottom/top, near/far: w + row and w - row
+        const float* row = m + 4 * (p / 2);
+        float sign = p % 2 == 0 ? 1.0f : -1.0f;
+        float a = m[12] + sign * row[0];
+        float b = m[13] + sign * row[1];
+        float c = m[14] + sign * row[2];
+        float d = m[15] + sign * row[3];
+        float length = std::sqrt(a * a + b * b + c * c);
+        f.a[p] = a / length;
+        f.b[p] = b / length;
+        f.c[p] = c / length;
+        f.d[p] = d / length;
+    }
+    return f;
+}
+
+// Fills 'visible' with the index of every sphere inside or touching the
+// frustum, its centre 'alpha' of the way from (previousX, previousY) to
+// (x, y), in ascending order
+inline void cullSpheres(const float* x, const float* y, const float* previousX, const float* previousY,
+                        const float* radius, size_t count, float alpha, const ViewFrustum& frustum,
+                        std::vector<uint32_t>& visible) {
+    visible.resize(count);
+    size_t visibleCount = 0;
+    size_t i = 0;
+#if FRUSTUM_CULLING_SSE2
+    __m128 a[6], b[6], d[6];
+    for (int p = 0; p < 6; p++) {
+        a[p] = _mm_set1_ps(frustum.a[p]);
+        b[p] = _mm_set1_ps(frustum.b[p]);
+        d[p] = _mm_set1_ps(frustum.d[p]);
+    }
+    __m128 alpha4 = _mm_set1_ps(alpha);
+    for (; i + 4 <= count; i += 4) {
+        __m128 px = _mm_loadu_ps(previousX + i);
+        __m128 py = _mm_loadu_ps(previousY + i);
+        __m128 cx = _mm_add_ps(px, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(x + i), px), alpha4));
+        __m128 cy = _mm_add_ps(py, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(y + i), py), alpha4));
+        __m128 negativeRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(radius + i));
+        __m128 inside = _mm_cmpeq_ps(cx, cx);  // all set (centres are never NaN)
+        for (int p = 0; p < 6; p++) {
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, a[p]), _mm_mul_ps(cy, b[p])), d[p]);
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negativeRadius));
+        }
+        // Branch-free compaction: visibility is close to random on dense scenes
+        int mask = _mm_movemask_ps(inside);
+        for (int k = 0; k < 4; k++) {
+            visible[visibleCount] = uint32_t(i + k);
+            visibleCount += (mask >> k) & 1;
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        float cx = previousX[i] + (x[i] - previousX[i]) * alpha;
+        float cy = previousY[i] + (y[i] - previousY[i]) * alpha;
+        bool inside = true;
+        for (int p = 0; p < 6; p++) {
+            inside = inside && cx * frustum.a[p] + cy * frustum.b[p] + frustum.d[p] >= -radius[i];
+        }
+        if (inside) visible[visibleCount++] = uint32_t(i);
+    }
+    visible.resize(visibleCount);
+}
+
+#endif
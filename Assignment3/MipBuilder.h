@@ -0,0 +1,422 @@
+//
+//  sRGB-correct mip chain builder
+//
+//  Texels are stored sRGB encoded, but averaging encoded values darkens
+//  every edge between light and dark areas. Each level is filtered in
+//  linear light instead: level 0 is decoded once into float planes, every
+//  further level is filtered from the previous one without requantizing,
+//  and each level is encoded back to sRGB bytes as it is produced.
+//
+//  Every level halves its parent, so one fixed kernel serves all texels:
+//     box      2 taps, the plain 2x2 average
+//     Kaiser   Kaiser-windowed sinc, 3 output texels each side (12 taps)
+//     Lanczos  Lanczos-3 (12 taps)
+//  The kernel runs separably, vertical then horizontal, wrapping in x
+//  (longitude) and clamping in y. Rows are split across threads, and the
+//  inner loops use AVX2 or SSE2 where available, with a scalar fallback.
+//
+
+#ifndef MIP_BUILDER_H
+#define MIP_BUILDER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MIP_BUILDER_SSE2 1
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#define MIP_BUILDER_AVX2 1
+#include <immintrin.h>
+#elif MIP_BUILDER_SSE2 && (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define MIP_BUILDER_AVX2 1              // compiled for AVX2 separately, picked at run time
+#define MIP_BUILDER_AVX2_DISPATCH 1
+#include <immintrin.h>
+#endif
+
+enum MipFilter { MipFilterBox = 0, MipFilterKaiser = 1, MipFilterLanczos = 2 };
+
+inline const char* mipFilterName(MipFilter filter) {
+    switch (filter) {
+        case MipFilterBox: return "box";
+        case MipFilterKaiser: return "Kaiser";
+        default: return "Lanczos";
+    }
+}
+
+// One level to fill: tightly packed RGB8, sRGB encoded
+struct MipLevelView {
+    unsigned char* pixels;
+    int width;
+    int height;
+};
+
+namespace mip_detail {
+
+const int MaxTaps = 12;
+
+//----------------------------------------------------------------------------
+// Kernels
+
+struct Kernel {
+    float weights[MaxTaps];
+    int taps;
+    int first;  // input offset of the first tap from 2 * output index
+};
+
+// Zeroth order modified Bessel function of the first kind
+inline double besselI0(double x) {
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 32; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+inline double sinc(double x) {
+    const double pi = 3.14159265358979323846;
+    return x == 0.0 ? 1.0 : std::sin(pi * x) / (pi * x);
+}
+
+// Taps for halving, normalized. Output texel x is centred on input
+// position 2x + 1, so input texel 2x + j lies (j - 0.5) / 2 output texels
+// away.
+inline Kernel makeKernel(MipFilter filter) {
+    Kernel k;
+    const double radius = 3.0;  // output texels, Kaiser and Lanczos
+    if (filter == MipFilterBox) {
+        k.taps = 2;
+        k.first = 0;
+        k.weights[0] = k.weights[1] = 0.5f;
+        return k;
+    }
+    k.taps = MaxTaps;
+    k.first = 1 - MaxTaps / 2;
+    double total = 0.0, w[MaxTaps];
+    for (int t = 0; t < MaxTaps; t++) {
+        double d = (k.first + t - 0.5) / 2.0;
+        if (filter == MipFilterKaiser) {
+            const double alpha = 4.0;
+            double r = d / radius;
+            w[t] = sinc(d) * besselI0(alpha * std::sqrt(std::max(1.0 - r * r, 0.0))) / besselI0(alpha);
+        } else {
+            w[t] = sinc(d) * sinc(d / radius);
+        }
+        total += w[t];
+    }
+    for (int t = 0; t < MaxTaps; t++) k.weights[t] = float(w[t] / total);
+    return k;
+}
+
+//----------------------------------------------------------------------------
+// sRGB conversion tables
+
+inline const float* srgbToLinearTable() {
+    static const std::vector<float> table = [] {
+        std::vector<float> t(256);
+        for (int i = 0; i < 256; i++) {
+            double c = i / 255.0;
+            t[i] = float(c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4));
+        }
+        return t;
+    }();
+    return table.data();
+}
+
+// Indexed by linear * LinearSteps; fine enough that the darkest codes stay exact
+const int LinearSteps = 65535;
+
+inline const unsigned char* linearToSrgbTable() {
+    static const std::vector<unsigned char> table = [] {
+        std::vector<unsigned char> t(LinearSteps + 1);
+        for (int i = 0; i <= LinearSteps; i++) {
+            double l = double(i) / LinearSteps;
+            double c = l <= 0.0031308 ? l * 12.92 : 1.055 * std::pow(l, 1.0 / 2.4) - 0.055;
+            t[i] = static_cast<unsigned char>(std::min(std::max(c * 255.0 + 0.5, 0.0), 255.0));
+        }
+        return t;
+    }();
+    return table.data();
+}
+
+//----------------------------------------------------------------------------
+// Row kernels: out[i] = sum of weights[k] * rows[k][i], and
+// out[x] = sum of weights[k] * in[2x + k] (the caller offsets 'in' by the
+// kernel's first tap)
+
+inline void verticalScalar(const float* const* rows, const float* weights, int taps, float* out, int count) {
+    for (int i = 0; i < count; i++) {
+        float sum = 0.0f;
+        for (int k = 0; k < taps; k++) sum += weights[k] * rows[k][i];
+        out[i] = sum;
+    }
+}
+
+inline void horizontalScalar(const float* in, const float* weights, int taps, float* out, int first, int count) {
+    for (int x = first; x < count; x++) {
+        const float* p = in + 2 * x;
+        float sum = 0.0f;
+        for (int k = 0; k < taps; k++) sum += weights[k] * p[k];
+        out[x] = sum;
+    }
+}
+
+#if MIP_BUILDER_SSE2
+inline void verticalSSE2(const float* const* rows, const float* weights, int taps, float* out, int count) {
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 sum = _mm_mul_ps(_mm_set1_ps(weights[0]), _mm_loadu_ps(rows[0] + i));
+        for (int k = 1; k < taps; k++) {
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[k]), _mm_loadu_ps(rows[k] + i)));
+        }
+        _mm_storeu_ps(out + i, sum);
+    }
+    const float* tails[MaxTaps];
+    for (int k = 0; k < taps; k++) tails[k] = rows[k] + i;
+    verticalScalar(tails, weights, taps, out + i, count - i);
+}
+
+// Four outputs per step: the even elements of two loads at each tap
+inline void horizontalSSE2(const float* in, const float* weights, int taps, float* out, int count) {
+    int x = 0;
+    for (; x + 4 <= count; x += 4) {
+        const float* p = in + 2 * x;
+        __m128 sum = _mm_setzero_ps();
+        for (int k = 0; k < taps; k++) {
+            __m128 even = _mm_shuffle_ps(_mm_loadu_ps(p + k), _mm_loadu_ps(p + k + 4), _MM_SHUFFLE(2, 0, 2, 0));
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[k]), even));
+        }
+        _mm_storeu_ps(out + x, sum);
+    }
+    horizontalScalar(in, weights, taps, out, x, count);
+}
+#endif
+
+#if MIP_BUILDER_AVX2
+#if MIP_BUILDER_AVX2_DISPATCH
+#define MIP_BUILDER_AVX2_TARGET __attribute__((target("avx2")))
+#else
+#define MIP_BUILDER_AVX2_TARGET
+#endif
+
+MIP_BUILDER_AVX2_TARGET
+inline void verticalAVX2(const float* const* rows, const float* weights, int taps, float* out, int count) {
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 sum = _mm256_mul_ps(_mm256_set1_ps(weights[0]), _mm256_loadu_ps(rows[0] + i));
+        for (int k = 1; k < taps; k++) {
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(weights[k]), _mm256_loadu_ps(rows[k] + i)));
+        }
+        _mm256_storeu_ps(out + i, sum);
+    }
+    const float* tails[MaxTaps];
+    for (int k = 0; k < taps; k++) tails[k] = rows[k] + i;
+    verticalScalar(tails, weights, taps, out + i, count - i);
+}
+
+// Eight outputs per step; the shuffle leaves the even elements in 128-bit
+// lane order (0 2 8 10 | 4 6 12 14), which the permute puts right
+MIP_BUILDER_AVX2_TARGET
+inline void horizontalAVX2(const float* in, const float* weights, int taps, float* out, int count) {
+    int x = 0;
+    for (; x + 8 <= count; x += 8) {
+        const float* p = in + 2 * x;
+        __m256 sum = _mm256_setzero_ps();
+        for (int k = 0; k < taps; k++) {
+            __m256 even = _mm256_shuffle_ps(_mm256_loadu_ps(p + k), _mm256_loadu_ps(p + k + 8), _MM_SHUFFLE(2, 0, 2, 0));
+            even = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(even), _MM_SHUFFLE(3, 1, 2, 0)));
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(weights[k]), even));
+        }
+        _mm256_storeu_ps(out + x, sum);
+    }
+    horizontalScalar(in, weights, taps, out, x, count);
+}
+#endif
+
+enum Isa { IsaScalar, IsaSSE2, IsaAVX2 };
+
+inline Isa detectIsa() {
+#if MIP_BUILDER_AVX2_DISPATCH
+    if (__builtin_cpu_supports("avx2")) return IsaAVX2;
+#elif MIP_BUILDER_AVX2
+    return IsaAVX2;
+#endif
+#if MIP_BUILDER_SSE2
+    return IsaSSE2;
+#else
+    return IsaScalar;
+#endif
+}
+
+inline const char* isaName(Isa isa) {
+    return isa == IsaAVX2 ? "AVX2" : isa == IsaSSE2 ? "SSE2" : "scalar";
+}
+
+inline void verticalRow(Isa isa, const float* const* rows, const float* weights, int taps, float* out, int count) {
+#if MIP_BUILDER_AVX2
+    if (isa == IsaAVX2) return verticalAVX2(rows, weights, taps, out, count);
+#endif
+#if MIP_BUILDER_SSE2
+    if (isa == IsaSSE2) return verticalSSE2(rows, weights, taps, out, count);
+#endif
+    verticalScalar(rows, weights, taps, out, count);
+}
+
+inline void horizontalRow(Isa isa, const float* in, const float* weights, int taps, float* out, int count) {
+#if MIP_BUILDER_AVX2
+    if (isa == IsaAVX2) return horizontalAVX2(in, weights, taps, out, count);
+#endif
+#if MIP_BUILDER_SSE2
+    if (isa == IsaSSE2) return horizontalSSE2(in, weights, taps, out, count);
+#endif
+    horizontalScalar(in, weights, taps, out, 0, count);
+}
+
+//----------------------------------------------------------------------------
+// Levels
+
+// A level in linear light, one float plane per channel
+struct LinearLevel {
+    int width = 0, height = 0;
+    std::vector<float> planes[3];
+};
+
+// Runs rowFunction(begin, end) over [0, rows) on up to 'threads' threads
+template <class RowFunction>
+void parallelRows(int rows, unsigned threads, RowFunction rowFunction) {
+    const int MinRowsPerThread = 16;
+    unsigned count = std::max(1u, std::min(threads, unsigned(rows / MinRowsPerThread)));
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < count; t++) {
+        workers.emplace_back(rowFunction, int(rows * uint64_t(t) / count), int(rows * uint64_t(t + 1) / count));
+    }
+    rowFunction(0, int(rows / count));
+    for (std::thread& worker : workers) worker.join();
+}
+
+// Source rows of a level already in linear light
+struct PlaneRows {
+    const LinearLevel& level;
+    const float* row(int c, int y) const { return level.planes[c].data() + size_t(y) * level.width; }
+};
+
+// Source rows of the RGB8 level 0, decoded on demand into a small ring so
+// the full-size level never exists in float. One output row needs MaxTaps
+// consecutive source rows and the next one starts two rows further down, so
+// RingRows > MaxTaps keeps every row of the current window resident.
+struct DecodedRows {
+    static const int RingRows = 16;
+    const unsigned char* pixels;
+    int width;
+    const float* table = srgbToLinearTable();
+    std::vector<float> ring;
+    int rowInSlot[RingRows];
+
+    DecodedRows(const unsigned char* pixels, int width)
+        : pixels(pixels), width(width), ring(size_t(RingRows) * 3 * width) {
+        std::fill(rowInSlot, rowInSlot + RingRows, -1);
+    }
+
+    const float* row(int c, int y) {
+        int slot = y % RingRows;
+        float* planes = &ring[size_t(slot) * 3 * width];
+        if (rowInSlot[slot] != y) {
+            const unsigned char* in = pixels + size_t(y) * width * 3;
+            for (int x = 0; x < width; x++) {
+                for (int k = 0; k < 3; k++) planes[size_t(k) * width + x] = table[in[3 * x + k]];
+            }
+            rowInSlot[slot] = y;
+        }
+        return planes + size_t(c) * width;
+    }
+};
+
+// Halves a srcWidth x srcHeight level into 'dst' with kernel 'k'. Each
+// worker reads source rows through its own makeSource().
+template <class MakeSource>
+void halveLevel(int srcWidth, int srcHeight, MakeSource makeSource, LinearLevel& dst, const Kernel& k, Isa isa,
+                unsigned threads) {
+    dst.width = std::max(srcWidth / 2, 1);
+    dst.height = std::max(srcHeight / 2, 1);
+    for (int c = 0; c < 3; c++) dst.planes[c].resize(size_t(dst.width) * dst.height);
+
+    // The vertically filtered row carries wrapped copies of its ends, so the
+    // horizontal taps never leave it. A 1-texel-wide level has no pairs to
+    // halve; its single column is filtered on its own.
+    int pad = MaxTaps;
+    parallelRows(dst.height, threads, [&](int begin, int end) {
+        auto source = makeSource();
+        std::vector<float> row(size_t(srcWidth) + 2 * pad + 16);
+        const float* rows[MaxTaps];
+        for (int y = begin; y < end; y++) {
+            for (int c = 0; c < 3; c++) {
+                for (int t = 0; t < k.taps; t++) {
+                    int sy = srcHeight == 1 ? 0 : 2 * y + k.first + t;
+                    rows[t] = source.row(c, std::min(std::max(sy, 0), srcHeight - 1));
+                }
+                float* centre = row.data() + pad;
+                verticalRow(isa, rows, k.weights, k.taps, centre, srcWidth);
+                for (int i = 1; i <= pad; i++) {
+                    centre[-i] = centre[((-i) % srcWidth + srcWidth) % srcWidth];
+                    centre[srcWidth - 1 + i] = centre[(i - 1) % srcWidth];
+                }
+                float* out = &dst.planes[c][size_t(y) * dst.width];
+                if (srcWidth == 1) {
+                    out[0] = centre[0];
+                } else {
+                    horizontalRow(isa, centre + k.first, k.weights, k.taps, out, dst.width);
+                }
+            }
+        }
+    });
+}
+
+// Negative lobes can overshoot [0, 1]; the table lookup clamps
+inline void encodeLevel(const LinearLevel& level, unsigned char* pixels, unsigned threads) {
+    const unsigned char* table = linearToSrgbTable();
+    parallelRows(level.height, threads, [&](int begin, int end) {
+        for (size_t i = size_t(begin) * level.width; i < size_t(end) * level.width; i++) {
+            for (int c = 0; c < 3; c++) {
+                float v = std::min(std::max(level.planes[c][i], 0.0f), 1.0f);
+                pixels[3 * i + c] = table[int(v * LinearSteps + 0.5f)];
+            }
+        }
+    });
+}
+
+}  // namespace mip_detail
+
+// Name of the instruction set the row kernels use on this machine
+inline const char* mipBuilderIsa() {
+    return mip_detail::isaName(mip_detail::detectIsa());
+}
+
+// Fills 'levels' (each half the size of the one before, the first half of
+// level 0) from the RGB8 level 0. 'threads' = 0 uses every hardware thread.
+inline void buildMipLevels(const unsigned char* level0, int width, int height, const MipLevelView* levels,
+                           int levelCount, MipFilter filter, unsigned threads = 0) {
+    using namespace mip_detail;
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    Isa isa = detectIsa();
+    Kernel k = makeKernel(filter);
+
+    // Level 0 is decoded row by row inside the first halving; after that
+    // the two float levels swap, so no level allocates more than once.
+    LinearLevel current, next;
+    for (int l = 0; l < levelCount; l++) {
+        if (l == 0) {
+            halveLevel(width, height, [&] { return DecodedRows(level0, width); }, next, k, isa, threads);
+        } else {
+            halveLevel(current.width, current.height, [&] { return PlaneRows{current}; }, next, k, isa, threads);
+        }
+        encodeLevel(next, levels[l].pixels, threads);
+        std::swap(current, next);
+    }
+}
+
+#endif
@@ -0,0 +1,282 @@
+//
+//  Fast PPM (P3/P6) image loader
+//
+//  The file is memory-mapped and parsed in place. Binary P6 data with
+//  maxval 255 is a straight copy; ASCII P3 data goes through a hand-written
+//  integer parser instead of iostream extraction. Samples with a maxval
+//  other than 255 (including 16-bit maxvals up to 65535) are rescaled to
+//  8 bits, so the result is always tightly packed RGB8.
+//
+
+#ifndef PPM_IMAGE_H
+#define PPM_IMAGE_H
+
+#include "TraceProfiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Larger sides are rejected as corrupt rather than allocated
+const unsigned MaxPPMSide = 65536;
+
+struct PPMImage {
+    int width = 0;
+    int height = 0;
+    int maxValue = 0;
+    char format = 0;                   // '3' (ASCII) or '6' (binary)
+    std::vector<unsigned char> pixels; // width * height * 3 bytes, RGB8
+};
+
+// Read-only view of a whole file, memory-mapped where the platform allows
+class MappedFile {
+public:
+    explicit MappedFile(const char* filename) {
+#ifdef _WIN32
+        std::ifstream file(filename, std::ios::binary | std::ios::ate);
+        if (!file.is_open()) return;
+        buffer.resize(size_t(file.tellg()));
+        file.seekg(0);
+        file.read(buffer.data(), buffer.size());
+        data = buffer.data();
+        size = buffer.size();
+#else
+        fd = open(filename, O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) return;
+        int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+        flags |= MAP_POPULATE;  // pre-fault the pages instead of one fault per 4 KB
+#endif
+        void* mapped = mmap(NULL, size_t(st.st_size), PROT_READ, flags, fd, 0);
+        if (mapped == MAP_FAILED) return;
+        madvise(mapped, size_t(st.st_size), MADV_SEQUENTIAL);
+        data = static_cast<const char*>(mapped);
+        size = size_t(st.st_size);
+#endif
+    }
+
+    ~MappedFile() {
+#ifndef _WIN32
+        if (data) munmap(const_cast<char*>(data), size);
+        if (fd >= 0) close(fd);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool isOpen() const { return data != NULL; }
+
+    const char* data = NULL;
+    size_t size = 0;
+
+private:
+#ifdef _WIN32
+    std::vector<char> buffer;
+#else
+    int fd = -1;
+#endif
+};
+
+namespace ppm_detail {
+
+inline bool isSpace(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\v' || c == '\f';
+}
+
+// Skips whitespace and '#' comments
+inline const char* skipSeparators(const char* p, const char* end) {
+    while (p < end) {
+        if (isSpace(*p)) {
+            p++;
+        } else if (*p == '#') {
+            while (p < end && *p != '\n') p++;
+        } else {
+            break;
+        }
+    }
+    return p;
+}
+
+// Parses one unsigned decimal integer, returns NULL if there is none.
+// Values too large for unsigned saturate instead of wrapping around.
+inline const char* parseUnsigned(const char* p, const char* end, unsigned& value) {
+    p = skipSeparators(p, end);
+    if (p >= end || unsigned(*p - '0') > 9) return NULL;
+    unsigned v = 0;
+    while (p < end && unsigned(*p - '0') <= 9) {
+        unsigned digit = unsigned(*p - '0');
+        v = v > (UINT_MAX - digit) / 10 ? UINT_MAX : v * 10 + digit;
+        p++;
+    }
+    value = v;
+    return p;
+}
+
+// Lookup table mapping [0, maxValue] onto [0, 255] with rounding
+inline std::vector<unsigned char> makeScaleTable(unsigned maxValue) {
+    std::vector<unsigned char> table(maxValue + 1);
+    for (unsigned v = 0; v <= maxValue; v++) {
+        table[v] = static_cast<unsigned char>((v * 255u + maxValue / 2) / maxValue);
+    }
+    return table;
+}
+
+// Inline digit loop, no locale or stream state involved. Everything at or
+// below ' ' counts as whitespace; '#' comments are rare enough to leave to
+// the slow path. Everything lives in locals: stores through 'out' may alias
+// any memory, so members would be reloaded on every sample. Returns the
+// number of samples parsed.
+template <bool Rescale>
+size_t parseAsciiSamples(const unsigned char* q, const unsigned char* end, unsigned char* out,
+                         size_t count, const unsigned char* scale, unsigned maxValue) {
+    for (size_t i = 0; i < count; i++) {
+        while (q < end && *q <= ' ') q++;
+        if (q < end && *q == '#') {
+            q = reinterpret_cast<const unsigned char*>(
+                skipSeparators(reinterpret_cast<const char*>(q), reinterpret_cast<const char*>(end)));
+        }
+
+        const unsigned char* start = q;
+        unsigned v = 0, digit;
+        while (q < end && (digit = unsigned(*q) - '0') <= 9) {
+            v = v * 10 + digit;
+            q++;
+        }
+        if (q == start) return i;
+
+        if (v > maxValue) v = maxValue;
+        out[i] = Rescale ? scale[v] : static_cast<unsigned char>(v);
+    }
+    return count;
+}
+
+}  // namespace ppm_detail
+
+// Parses a PPM image held in memory
+inline bool parsePPM(const char* data, size_t size, PPMImage& image, std::string& error) {
+    TRACE_ZONE("parsePPM");
+    using namespace ppm_detail;
+    const char* p = data;
+    const char* end = data + size;
+
+    if (size < 2 || p[0] != 'P' || (p[1] != '3' && p[1] != '6')) {
+        error = "not a P3/P6 PPM file";
+        return false;
+    }
+    image.format = p[1];
+    p += 2;
+
+    unsigned width, height, maxValue;
+    if (!(p = parseUnsigned(p, end, width)) ||
+        !(p = parseUnsigned(p, end, height)) ||
+        !(p = parseUnsigned(p, end, maxValue))) {
+        error = "malformed header";
+        return false;
+    }
+    if (width == 0 || height == 0 || width > MaxPPMSide || height > MaxPPMSide ||
+        maxValue == 0 || maxValue > 65535) {
+        error = "unsupported dimensions or maxval";
+        return false;
+    }
+    size_t bytesPerSample = maxValue > 255 ? 2 : 1;
+    if (uint64_t(width) * height * 3 * bytesPerSample > SIZE_MAX) {
+        error = "image too large";
+        return false;
+    }
+    size_t count = size_t(width) * height * 3;
+
+    // Check the data is there before allocating for it: a binary sample
+    // takes bytesPerSample bytes, an ASCII one at least one digit
+    if (image.format == '6') {
+        // Exactly one whitespace byte separates the header from the raster
+        p++;
+        if (p > end || size_t(end - p) < count * bytesPerSample) {
+            error = "truncated binary data";
+            return false;
+        }
+    } else if (size_t(end - p) < count) {
+        error = "truncated ASCII data";
+        return false;
+    }
+
+    image.width = int(width);
+    image.height = int(height);
+    image.maxValue = int(maxValue);
+    image.pixels.resize(count);
+    unsigned char* out = image.pixels.data();
+
+    std::vector<unsigned char> scale;
+    if (maxValue != 255) scale = makeScaleTable(maxValue);
+
+    if (image.format == '6') {
+        const unsigned char* raster = reinterpret_cast<const unsigned char*>(p);
+        if (maxValue == 255) {
+            std::memcpy(out, raster, count);
+        } else if (bytesPerSample == 1) {
+            for (size_t i = 0; i < count; i++) out[i] = scale[std::min<unsigned>(raster[i], maxValue)];
+        } else {
+            for (size_t i = 0; i < count; i++) {
+                unsigned v = (unsigned(raster[2 * i]) << 8) | raster[2 * i + 1];  // big-endian
+                out[i] = scale[std::min(v, maxValue)];
+            }
+        }
+        return true;
+    }
+
+    // ASCII raster
+    const unsigned char* q = reinterpret_cast<const unsigned char*>(p);
+    const unsigned char* qend = reinterpret_cast<const unsigned char*>(end);
+    size_t parsed = scale.empty()
+        ? parseAsciiSamples<false>(q, qend, out, count, NULL, maxValue)
+        : parseAsciiSamples<true>(q, qend, out, count, scale.data(), maxValue);
+    if (parsed != count) {
+        error = "bad ASCII sample at position " + std::to_string(parsed);
+        return false;
+    }
+    return true;
+}
+
+// Loads a PPM file and reports the parse throughput
+inline bool readPPMImage(const std::string& filename, PPMImage& image) {
+    TRACE_ZONE("readPPMImage");
+    auto start = std::chrono::steady_clock::now();
+
+    MappedFile file(filename.c_str());
+    if (!file.isOpen()) {
+        std::cout << "Cannot open file: " << filename << std::endl;
+        return false;
+    }
+
+    std::string error;
+    if (!parsePPM(file.data, file.size, image, error)) {
+        std::cout << "Error reading " << filename << ": " << error << std::endl;
+        return false;
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double megabytes = file.size / (1024.0 * 1024.0);
+    std::cout << "Read " << filename << " (P" << image.format << ", "
+              << image.width << "x" << image.height << ", maxval " << image.maxValue << ") in "
+              << seconds * 1000.0 << " ms, " << megabytes / std::max(seconds, 1e-9) << " MB/s" << std::endl;
+    return true;
+}
+
+#endif
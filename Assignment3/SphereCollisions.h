@@ -0,0 +1,264 @@
+//
+//  Sphere-sphere collisions
+//
+//  All spheres move in the z = 0 plane, so collisions are between circles.
+//  The broad phase is sweep and prune along x, run per horizontal strip:
+//  a single sweep over the whole screen would compare each sphere with
+//  every sphere in the same vertical slice, which grows with the square
+//  root of the sphere count. Strips are as tall as the largest typical
+//  sphere, so a sphere can only touch spheres in its own strip and the
+//  next one. Spheres much larger than the rest (sphere 0) would make every
+//  strip tall; they are tested against everything instead.
+//
+//  Spheres are sorted by strip, then by the left edge of their bounding
+//  box, with an LSD radix sort on one 32-bit key per sphere: the strip in
+//  the top 11 bits and the left edge quantized to the remaining 21 (floor
+//  is monotonic, so comparing quantized edges never skips an overlapping
+//  pair). The sort is linear in the sphere count no matter how far spheres
+//  moved since the last frame (respawns jump across the whole screen,
+//  which defeats an insertion sort of last frame's order). Candidates go
+//  straight to the exact circle test.
+//
+//  bruteForcePairs() tests every pair and is kept as the reference and for
+//  small sphere counts, where it is faster.
+//
+
+#ifndef SPHERE_COLLISIONS_H
+#define SPHERE_COLLISIONS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+struct SpherePair {
+    uint32_t a, b;
+};
+
+namespace collision_detail {
+
+inline bool circlesOverlap(float dx, float dy, float radii) {
+    return dx * dx + dy * dy < radii * radii;
+}
+
+}  // namespace collision_detail
+
+// O(n^2) reference
+inline void bruteForcePairs(const float* x, const float* y, const float* radius, size_t count,
+                            std::vector<SpherePair>& pairs) {
+    pairs.clear();
+    for (size_t i = 0; i < count; i++) {
+        for (size_t j = i + 1; j < count; j++) {
+            if (collision_detail::circlesOverlap(x[j] - x[i], y[j] - y[i], radius[i] + radius[j])) {
+                pairs.push_back(SpherePair{ uint32_t(i), uint32_t(j) });
+            }
+        }
+    }
+}
+
+class SweepAndPrune {
+public:
+    void findPairs(const float* x, const float* y, const float* radius, size_t count,
+                   std::vector<SpherePair>& pairs) {
+        pairs.clear();
+        if (count == 0) return;
+
+        // Strip height from the typical spheres; the others are oversized
+        float radiusSum = 0.0f;
+        for (size_t i = 0; i < count; i++) radiusSum += radius[i];
+        float oversizedRadius = 2.0f * radiusSum / count;
+        float maxRadius = 0.0f;
+        float minY = y[0], maxY = y[0];
+        float minLeft = x[0], maxRight = x[0];
+        oversized.clear();
+        for (size_t i = 0; i < count; i++) {
+            if (radius[i] > oversizedRadius) {
+                oversized.push_back(uint32_t(i));
+                continue;
+            }
+            maxRadius = std::max(maxRadius, radius[i]);
+            minY = std::min(minY, y[i]);
+            maxY = std::max(maxY, y[i]);
+            minLeft = std::min(minLeft, x[i] - radius[i]);
+            maxRight = std::max(maxRight, x[i] + radius[i]);
+        }
+        float stripHeight = std::max(2.0f * maxRadius, (maxY - minY) / (MaxStrips - 1));
+        if (stripHeight <= 0.0f) stripHeight = 1.0f;
+        float edgeScale = maxRight > minLeft ? EdgeMask / (maxRight - minLeft) : 0.0f;
+
+        // Keys of the spheres that are not oversized
+        keys.clear();
+        order.clear();
+        size_t next = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (next < oversized.size() && oversized[next] == i) {
+                next++;
+                continue;
+            }
+            uint32_t strip = std::min(uint32_t((y[i] - minY) / stripHeight), MaxStrips - 1);
+            keys.push_back((strip << StripShift) | quantize(x[i] - radius[i], minLeft, edgeScale));
+            order.push_back(uint32_t(i));
+        }
+        radixSort();
+
+        // Gather the sorted spheres so the sweeps read memory in order
+        size_t sorted = order.size();
+        sortedX.resize(sorted);
+        sortedY.resize(sorted);
+        sortedRadius.resize(sorted);
+        left.resize(sorted);
+        right.resize(sorted);
+        for (size_t k = 0; k < sorted; k++) {
+            uint32_t i = order[k];
+            sortedX[k] = x[i];
+            sortedY[k] = y[i];
+            sortedRadius[k] = radius[i];
+            left[k] = keys[k] & EdgeMask;
+            right[k] = quantize(x[i] + radius[i], minLeft, edgeScale);
+        }
+
+        // Strip boundaries: strip s is [stripStart[s], stripStart[s + 1])
+        stripStart.assign(MaxStrips + 1, 0);
+        for (size_t k = 0; k < sorted; k++) stripStart[(keys[k] >> StripShift) + 1]++;
+        for (uint32_t s = 0; s < MaxStrips; s++) stripStart[s + 1] += stripStart[s];
+
+        for (uint32_t s = 0; s < MaxStrips; s++) {
+            if (stripStart[s] == stripStart[s + 1]) continue;
+            sweep(stripStart[s], stripStart[s + 1], pairs);
+            if (s + 1 < MaxStrips) {
+                sweepAcross(stripStart[s], stripStart[s + 1], stripStart[s + 1], stripStart[s + 2], pairs);
+            }
+        }
+
+        // Oversized spheres against all others, and among themselves
+        for (size_t o = 0; o < oversized.size(); o++) {
+            uint32_t a = oversized[o];
+            for (size_t k = 0; k < sorted; k++) {
+                if (collision_detail::circlesOverlap(sortedX[k] - x[a], sortedY[k] - y[a],
+                                                     sortedRadius[k] + radius[a])) {
+                    pairs.push_back(SpherePair{ a, order[k] });
+                }
+            }
+            for (size_t p = o + 1; p < oversized.size(); p++) {
+                uint32_t b = oversized[p];
+                if (collision_detail::circlesOverlap(x[b] - x[a], y[b] - y[a], radius[a] + radius[b])) {
+                    pairs.push_back(SpherePair{ a, b });
+                }
+            }
+        }
+    }
+
+private:
+    static const int StripBits = 11;
+    static const uint32_t MaxStrips = 1u << StripBits;
+    static const int StripShift = 32 - StripBits;
+    static const uint32_t EdgeMask = (1u << StripShift) - 1;
+
+    static uint32_t quantize(float edge, float minLeft, float edgeScale) {
+        return std::min(uint32_t(std::max(edge - minLeft, 0.0f) * edgeScale), uint32_t(EdgeMask));
+    }
+
+    void test(size_t j, size_t k, std::vector<SpherePair>& pairs) const {
+        if (collision_detail::circlesOverlap(sortedX[k] - sortedX[j], sortedY[k] - sortedY[j],
+                                             sortedRadius[j] + sortedRadius[k])) {
+            pairs.push_back(SpherePair{ order[j], order[k] });
+        }
+    }
+
+    // Pairs within [begin, end), sorted by left edge
+    void sweep(size_t begin, size_t end, std::vector<SpherePair>& pairs) const {
+        for (size_t k = begin; k < end; k++) {
+            for (size_t m = k + 1; m < end && left[m] <= right[k]; m++) {
+                test(k, m, pairs);
+            }
+        }
+    }
+
+    // Pairs between two sorted ranges: walking both in left-edge order,
+    // whichever interval starts first scans the other range
+    void sweepAcross(size_t a, size_t aEnd, size_t b, size_t bEnd, std::vector<SpherePair>& pairs) const {
+        while (a < aEnd && b < bEnd) {
+            if (left[a] <= left[b]) {
+                for (size_t m = b; m < bEnd && left[m] <= right[a]; m++) test(a, m, pairs);
+                a++;
+            } else {
+                for (size_t m = a; m < aEnd && left[m] <= right[b]; m++) test(m, b, pairs);
+                b++;
+            }
+        }
+    }
+
+    // Three 11-bit passes over (key, index)
+    void radixSort() {
+        const int Bits = 11;
+        const uint32_t Buckets = 1u << Bits;
+        size_t sorted = keys.size();
+        scratchKeys.resize(sorted);
+        scratchOrder.resize(sorted);
+        histogram.resize(Buckets);
+        for (int shift = 0; shift < 32; shift += Bits) {
+            std::fill(histogram.begin(), histogram.end(), 0);
+            for (size_t i = 0; i < sorted; i++) histogram[(keys[i] >> shift) & (Buckets - 1)]++;
+            uint32_t sum = 0;
+            for (uint32_t b = 0; b < Buckets; b++) {
+                uint32_t n = histogram[b];
+                histogram[b] = sum;
+                sum += n;
+            }
+            for (size_t i = 0; i < sorted; i++) {
+                uint32_t slot = histogram[(keys[i] >> shift) & (Buckets - 1)]++;
+                scratchKeys[slot] = keys[i];
+                scratchOrder[slot] = order[i];
+            }
+            keys.swap(scratchKeys);
+            order.swap(scratchOrder);
+        }
+    }
+
+    std::vector<uint32_t> keys, scratchKeys, order, scratchOrder, oversized, histogram, stripStart;
+    std::vector<uint32_t> left, right;  // quantized bounding box edges, in sorted order
+    std::vector<float> sortedX, sortedY, sortedRadius;
+};
+
+// Separates each overlapping pair: an impulse along the line of centres
+// keeps 'restitution' of the approach speed, and the spheres are pushed
+// apart until they just touch. Masses grow with radius^3.
+inline void resolveSphereCollisions(const std::vector<SpherePair>& pairs, float* x, float* y,
+                                    float* velocityX, float* velocityY, const float* radius,
+                                    float restitution) {
+    for (size_t p = 0; p < pairs.size(); p++) {
+        uint32_t a = pairs[p].a, b = pairs[p].b;
+        float dx = x[b] - x[a];
+        float dy = y[b] - y[a];
+        float distance = std::sqrt(dx * dx + dy * dy);
+        float radii = radius[a] + radius[b];
+        if (distance >= radii) continue;  // already moved apart by an earlier pair
+
+        float nx = 1.0f, ny = 0.0f;
+        if (distance > 1e-6f) {
+            nx = dx / distance;
+            ny = dy / distance;
+        }
+        float inverseMassA = 1.0f / (radius[a] * radius[a] * radius[a]);
+        float inverseMassB = 1.0f / (radius[b] * radius[b] * radius[b]);
+        float inverseMassSum = inverseMassA + inverseMassB;
+
+        float approach = (velocityX[b] - velocityX[a]) * nx + (velocityY[b] - velocityY[a]) * ny;
+        if (approach < 0.0f) {
+            float impulse = -(1.0f + restitution) * approach / inverseMassSum;
+            velocityX[a] -= impulse * inverseMassA * nx;
+            velocityY[a] -= impulse * inverseMassA * ny;
+            velocityX[b] += impulse * inverseMassB * nx;
+            velocityY[b] += impulse * inverseMassB * ny;
+        }
+
+        float push = (radii - distance) / inverseMassSum;
+        x[a] -= push * inverseMassA * nx;
+        y[a] -= push * inverseMassA * ny;
+        x[b] += push * inverseMassB * nx;
+        y[b] += push * inverseMassB * ny;
+    }
+}
+
+#endif
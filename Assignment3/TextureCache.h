@@ -0,0 +1,362 @@
+//
+//  Preprocessed texture cache
+//
+//  The first time a PPM texture is used it is decoded, its full mip chain is
+//  built on the CPU and the result is written next to the source as
+//  "<source>.mipcache". Later runs memory-map that file and upload the levels
+//  as they are stored: tightly packed RGB8, largest level first, with no
+//  conversion and no glGenerateMipmap.
+//
+//  Level 0 can be resampled to a requested size (all layers of a texture
+//  array share one size); that size is part of the cache key. The smaller
+//  levels are filtered in linear light by MipBuilder.h; the filter is part
+//  of the key as well.
+//
+//  The cache records the size, modification time and a 64-bit content hash
+//  of its source. If size and time still match the cache is used as is; if
+//  they differ the source is re-hashed and the cache is rebuilt only when the
+//  contents actually changed.
+//
+
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include "MipBuilder.h"
+#include "PPMImage.h"
+#include "TraceProfiler.h"
+
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <sys/stat.h>
+
+const uint32_t MipCacheVersion = 3;
+
+struct MipCacheHeader {
+    char     magic[8];        // "MIPCACHE"
+    uint32_t version;
+    uint32_t levelCount;
+    uint64_t sourceHash;
+    uint64_t sourceSize;
+    int64_t  sourceTime;
+    uint32_t width;           // level 0, after resampling
+    uint32_t height;
+    uint32_t filter;          // MipFilter of levels 1 and up
+    uint32_t reserved;
+    uint64_t dataOffset;      // start of the pixel data, from the start of the file
+    uint64_t dataSize;
+};
+
+struct MipCacheLevel {
+    uint64_t offset;          // from dataOffset
+    uint64_t size;
+    uint32_t width;
+    uint32_t height;
+};
+
+// A complete mip chain in one contiguous block, either inside a mapped cache
+// file or in memory that was just built
+struct MipChain {
+    std::vector<MipCacheLevel> levels;
+    const unsigned char* data = NULL;
+    size_t dataSize = 0;
+
+    std::unique_ptr<MappedFile> mapping;
+    std::vector<unsigned char> storage;
+};
+
+//----------------------------------------------------------------------------
+// Hashing and file metadata
+
+// FNV-1a over 64-bit words (tail bytes one at a time)
+inline uint64_t hashBytes(const void* data, size_t size) {
+    const uint64_t prime = 0x100000001b3ULL;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    size_t words = size / 8;
+    for (size_t i = 0; i < words; i++) {
+        uint64_t w;
+        std::memcpy(&w, p + 8 * i, 8);
+        hash = (hash ^ w) * prime;
+    }
+    for (size_t i = words * 8; i < size; i++) {
+        hash = (hash ^ p[i]) * prime;
+    }
+    return hash;
+}
+
+inline bool fileStat(const std::string& filename, uint64_t& size, int64_t& time) {
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) return false;
+    size = uint64_t(st.st_size);
+    time = int64_t(st.st_mtime);
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// Resampling
+
+struct FilterTap {
+    int index;
+    float weight;
+};
+
+// Tent filter taps for resampling one axis from srcSize to dstSize samples.
+// The filter widens with the minification ratio so every source texel
+// contributes; 'wrap' repeats at the edges (longitude), otherwise clamps.
+inline std::vector<std::vector<FilterTap> > tentTaps(int srcSize, int dstSize, bool wrap) {
+    std::vector<std::vector<FilterTap> > taps(dstSize);
+    float scale = float(srcSize) / dstSize;
+    float radius = std::max(scale, 1.0f);
+    for (int i = 0; i < dstSize; i++) {
+        float center = (i + 0.5f) * scale - 0.5f;
+        int first = int(std::floor(center - radius)) + 1;
+        int last = int(std::floor(center + radius));
+        float total = 0.0f;
+        for (int j = first; j <= last; j++) {
+            float w = 1.0f - std::fabs(j - center) / radius;
+            if (w <= 0.0f) continue;
+            int index = wrap ? ((j % srcSize) + srcSize) % srcSize : std::min(std::max(j, 0), srcSize - 1);
+            taps[i].push_back({ index, w });
+            total += w;
+        }
+        for (FilterTap& t : taps[i]) t.weight /= total;
+    }
+    return taps;
+}
+
+// Separable tent resample of a tightly packed RGB8 image
+inline void resampleRGB8(const unsigned char* src, int srcWidth, int srcHeight,
+                         unsigned char* dst, int dstWidth, int dstHeight) {
+    std::vector<std::vector<FilterTap> > xTaps = tentTaps(srcWidth, dstWidth, true);
+    std::vector<std::vector<FilterTap> > yTaps = tentTaps(srcHeight, dstHeight, false);
+
+    // Horizontal pass into floats
+    std::vector<float> rows(size_t(srcHeight) * dstWidth * 3);
+    for (int y = 0; y < srcHeight; y++) {
+        const unsigned char* in = src + size_t(y) * srcWidth * 3;
+        float* out = &rows[size_t(y) * dstWidth * 3];
+        for (int x = 0; x < dstWidth; x++) {
+            float r = 0, g = 0, b = 0;
+            for (const FilterTap& t : xTaps[x]) {
+                const unsigned char* p = in + 3 * t.index;
+                r += t.weight * p[0];
+                g += t.weight * p[1];
+                b += t.weight * p[2];
+            }
+            out[3 * x] = r;
+            out[3 * x + 1] = g;
+            out[3 * x + 2] = b;
+        }
+    }
+
+    // Vertical pass back to bytes
+    std::vector<float> acc(size_t(dstWidth) * 3);
+    for (int y = 0; y < dstHeight; y++) {
+        std::fill(acc.begin(), acc.end(), 0.0f);
+        for (const FilterTap& t : yTaps[y]) {
+            const float* in = &rows[size_t(t.index) * dstWidth * 3];
+            for (int i = 0; i < dstWidth * 3; i++) acc[i] += t.weight * in[i];
+        }
+        unsigned char* out = dst + size_t(y) * dstWidth * 3;
+        for (int i = 0; i < dstWidth * 3; i++) {
+            out[i] = static_cast<unsigned char>(std::min(std::max(acc[i] + 0.5f, 0.0f), 255.0f));
+        }
+    }
+}
+
+inline int mipLevelCount(int width, int height) {
+    int levels = 1;
+    while (width > 1 || height > 1) {
+        width = std::max(width / 2, 1);
+        height = std::max(height / 2, 1);
+        levels++;
+    }
+    return levels;
+}
+
+// Builds every mip level of 'image', resampled to width x height, into
+// chain.storage. Level 0 is the tent resample; the rest come from it with
+// 'filter'.
+inline void buildMipChain(const PPMImage& image, int width, int height, MipFilter filter, MipChain& chain) {
+    TRACE_ZONE("buildMipChain");
+    int levelCount = mipLevelCount(width, height);
+    chain.levels.resize(levelCount);
+
+    uint64_t offset = 0;
+    int w = width, h = height;
+    for (int level = 0; level < levelCount; level++) {
+        MipCacheLevel& l = chain.levels[level];
+        l.offset = offset;
+        l.width = uint32_t(w);
+        l.height = uint32_t(h);
+        l.size = uint64_t(w) * h * 3;
+        offset += (l.size + 63) & ~uint64_t(63);  // keep each level cache-line aligned
+        w = std::max(w / 2, 1);
+        h = std::max(h / 2, 1);
+    }
+
+    chain.storage.assign(size_t(offset), 0);
+    if (image.width == width && image.height == height) {
+        std::memcpy(chain.storage.data(), image.pixels.data(), image.pixels.size());
+    } else {
+        resampleRGB8(image.pixels.data(), image.width, image.height, chain.storage.data(), width, height);
+    }
+    std::vector<MipLevelView> views;
+    for (int level = 1; level < levelCount; level++) {
+        const MipCacheLevel& l = chain.levels[level];
+        views.push_back({ chain.storage.data() + l.offset, int(l.width), int(l.height) });
+    }
+    buildMipLevels(chain.storage.data(), width, height, views.data(), int(views.size()), filter);
+
+    chain.data = chain.storage.data();
+    chain.dataSize = chain.storage.size();
+}
+
+//----------------------------------------------------------------------------
+// Cache file I/O
+
+inline std::string mipCacheFilename(const std::string& source) {
+    return source + ".mipcache";
+}
+
+// Maps an existing cache file and checks it against the source. The file
+// is not trusted: every level must have the size and byte count of the
+// chain buildMipChain() would make for width x height, and lie inside the
+// file. Sizes read from it are only ever compared against what is left of
+// the file, never added, so a corrupt header cannot wrap a check.
+inline bool openMipCache(const std::string& source, int width, int height, MipFilter filter, uint64_t sourceSize,
+                         int64_t sourceTime, const uint64_t* sourceHash, MipChain& chain,
+                         MipCacheHeader& header) {
+    std::unique_ptr<MappedFile> file(new MappedFile(mipCacheFilename(source).c_str()));
+    if (!file->isOpen() || file->size < sizeof(MipCacheHeader)) return false;
+
+    std::memcpy(&header, file->data, sizeof(header));
+    if (std::memcmp(header.magic, "MIPCACHE", 8) != 0 || header.version != MipCacheVersion ||
+        header.width != uint32_t(width) || header.height != uint32_t(height) ||
+        header.filter != uint32_t(filter) || header.levelCount != uint32_t(mipLevelCount(width, height)) ||
+        header.dataOffset > file->size || header.dataSize > file->size - header.dataOffset ||
+        header.dataOffset < sizeof(header) + uint64_t(header.levelCount) * sizeof(MipCacheLevel)) {
+        return false;
+    }
+
+    bool sameFile = header.sourceSize == sourceSize && header.sourceTime == sourceTime;
+    bool sameContents = sourceHash != NULL && header.sourceHash == *sourceHash;
+    if (!sameFile && !sameContents) return false;
+
+    chain.levels.resize(header.levelCount);
+    std::memcpy(chain.levels.data(), file->data + sizeof(header), header.levelCount * sizeof(MipCacheLevel));
+    int w = width, h = height;
+    for (const MipCacheLevel& l : chain.levels) {
+        if (l.width != uint32_t(w) || l.height != uint32_t(h) || l.size != uint64_t(w) * h * 3 ||
+            l.offset > header.dataSize || l.size > header.dataSize - l.offset) {
+            return false;
+        }
+        w = std::max(w / 2, 1);
+        h = std::max(h / 2, 1);
+    }
+
+    chain.data = reinterpret_cast<const unsigned char*>(file->data) + header.dataOffset;
+    chain.dataSize = size_t(header.dataSize);
+    chain.mapping = std::move(file);
+    return true;
+}
+
+// Writes the cache through a temporary file so readers never see a partial one
+inline bool writeMipCache(const std::string& source, const MipCacheHeader& header, const MipChain& chain) {
+    std::string filename = mipCacheFilename(source);
+    std::string temp = filename + ".tmp";
+    FILE* fp = fopen(temp.c_str(), "wb");
+    if (fp == NULL) return false;
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(chain.levels.data(), sizeof(MipCacheLevel), chain.levels.size(), fp) == chain.levels.size();
+    long padding = long(header.dataOffset) - ftell(fp);
+    for (long i = 0; ok && i < padding; i++) ok = fputc(0, fp) != EOF;
+    ok = ok && fwrite(chain.data, 1, chain.dataSize, fp) == chain.dataSize;
+    ok = fclose(fp) == 0 && ok;
+
+    if (!ok || rename(temp.c_str(), filename.c_str()) != 0) {
+        remove(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Returns the mip chain for a PPM texture at width x height, from the cache
+// when it is valid
+inline bool loadTextureCached(const std::string& source, int width, int height, MipFilter filter,
+                              MipChain& chain) {
+    TRACE_ZONE("loadTextureCached");
+    auto start = std::chrono::steady_clock::now();
+
+    uint64_t sourceSize;
+    int64_t sourceTime;
+    if (!fileStat(source, sourceSize, sourceTime)) {
+        std::cout << "Cannot open file: " << source << std::endl;
+        return false;
+    }
+
+    // Fast path: size and modification time unchanged
+    MipCacheHeader header;
+    if (openMipCache(source, width, height, filter, sourceSize, sourceTime, NULL, chain, header)) {
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Mapped " << mipCacheFilename(source) << " (" << chain.levels.size()
+                  << " levels) in " << ms << " ms" << std::endl;
+        return true;
+    }
+
+    MappedFile file(source.c_str());
+    if (!file.isOpen()) {
+        std::cout << "Cannot open file: " << source << std::endl;
+        return false;
+    }
+    uint64_t sourceHash = hashBytes(file.data, file.size);
+
+    // The file was touched but its contents are the same: refresh the stored
+    // time so the next run takes the fast path again
+    if (openMipCache(source, width, height, filter, sourceSize, sourceTime, &sourceHash, chain, header)) {
+        header.sourceSize = sourceSize;
+        header.sourceTime = sourceTime;
+        FILE* fp = fopen(mipCacheFilename(source).c_str(), "r+b");
+        if (fp != NULL) {
+            fwrite(&header, sizeof(header), 1, fp);
+            fclose(fp);
+        }
+        std::cout << "Mapped " << mipCacheFilename(source) << " (source unchanged)" << std::endl;
+        return true;
+    }
+
+    PPMImage image;
+    std::string error;
+    if (!parsePPM(file.data, file.size, image, error)) {
+        std::cout << "Error reading " << source << ": " << error << std::endl;
+        return false;
+    }
+    auto buildStart = std::chrono::steady_clock::now();
+    buildMipChain(image, width, height, filter, chain);
+    double buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - buildStart).count();
+
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "MIPCACHE", 8);
+    header.version = MipCacheVersion;
+    header.levelCount = uint32_t(chain.levels.size());
+    header.sourceHash = sourceHash;
+    header.sourceSize = sourceSize;
+    header.sourceTime = sourceTime;
+    header.width = uint32_t(width);
+    header.height = uint32_t(height);
+    header.filter = uint32_t(filter);
+    header.dataOffset = (sizeof(header) + chain.levels.size() * sizeof(MipCacheLevel) + 63) & ~uint64_t(63);
+    header.dataSize = chain.dataSize;
+
+    bool written = writeMipCache(source, header, chain);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Built " << chain.levels.size() << " mip levels for " << source << " in " << ms << " ms ("
+              << mipFilterName(filter) << ", " << mipBuilderIsa() << ", "
+              << width * double(height) / (buildMs * 1000.0) << " MP/s)"
+              << (written ? "" : " (cache not written)") << std::endl;
+    return true;
+}
+
+#endif
@@ -0,0 +1,464 @@
+//
+//  Virtual texture tiles and streaming
+//
+//  A texture too large to keep on the GPU is cut once into a pyramid of
+//  square tiles, written next to the source as "<source>.vtiles": level 0 is
+//  the source itself, each further level halves it with the same linear-light
+//  MipFilter as the texture array (MipBuilder.h), and the last level fits
+//  in a single tile. Every tile carries a border of neighbouring texels
+//  (wrapping in s, clamped in t) so it can be filtered on its own.
+//
+//  At run time only the tiles the scene shows are kept, in a fixed number
+//  of physical slots. A loader thread reads requested tiles from the file;
+//  the main thread assigns them slots, evicting the least recently used
+//  tile, and maintains the page table: one RGBA8 entry per tile position of
+//  every level, holding the slot of the closest resident tile that covers
+//  it and that tile's level. Nothing here touches OpenGL; main.cpp copies
+//  the tiles into its atlas texture and uploads the page table.
+//
+//  Building the tiles is a one-off pass that decodes the whole source in
+//  memory; the file is rebuilt when the source's size or time changes.
+//
+
+#ifndef VIRTUAL_TEXTURE_H
+#define VIRTUAL_TEXTURE_H
+
+#include "PPMImage.h"
+#include "TextureCache.h"
+#include "TraceProfiler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+const uint32_t VirtualTileVersion = 2;
+const int VirtualTileSize = 128;    // texels per side, without the border
+const int VirtualTileBorder = 1;    // enough for bilinear filtering
+const int VirtualTileStride = VirtualTileSize + 2 * VirtualTileBorder;
+const size_t VirtualTileBytes = size_t(VirtualTileStride) * VirtualTileStride * 3;  // RGB8
+const int VirtualMaxLevels = 16;
+const int VirtualMaxPages = 256;    // per side at level 0; page coordinates are fed back as bytes
+
+struct VirtualTileHeader {
+    char     magic[8];        // "VTILES\0\0"
+    uint32_t version;
+    uint32_t tileSize;
+    uint32_t border;
+    uint32_t levelCount;
+    uint64_t sourceSize;
+    int64_t  sourceTime;
+    uint32_t width;           // level 0
+    uint32_t height;
+    uint32_t filter;          // MipFilter of levels 1 and up
+    uint32_t reserved;
+    uint64_t dataOffset;      // first tile, from the start of the file
+};
+
+struct VirtualTileLevel {
+    uint32_t width;
+    uint32_t height;
+    uint32_t tilesX;
+    uint32_t tilesY;
+    uint64_t firstTile;       // tiles are stored level by level, row by row
+};
+
+inline std::string virtualTileFilename(const std::string& source) {
+    return source + ".vtiles";
+}
+
+// The pyramid of a width x height texture, down to a single tile
+inline std::vector<VirtualTileLevel> virtualTileLevels(int width, int height) {
+    std::vector<VirtualTileLevel> levels;
+    uint64_t firstTile = 0;
+    int w = width, h = height;
+    while (true) {
+        VirtualTileLevel l;
+        l.width = uint32_t(w);
+        l.height = uint32_t(h);
+        l.tilesX = uint32_t((w + VirtualTileSize - 1) / VirtualTileSize);
+        l.tilesY = uint32_t((h + VirtualTileSize - 1) / VirtualTileSize);
+        l.firstTile = firstTile;
+        levels.push_back(l);
+        firstTile += uint64_t(l.tilesX) * l.tilesY;
+        if (l.tilesX == 1 && l.tilesY == 1) break;
+        w = std::max(w / 2, 1);
+        h = std::max(h / 2, 1);
+    }
+    return levels;
+}
+
+//----------------------------------------------------------------------------
+// Building the tile file
+
+// Copies tile (tileX, tileY) with its border out of one level
+inline void extractTile(const unsigned char* image, int width, int height, int tileX, int tileY,
+                        unsigned char* tile) {
+    for (int y = 0; y < VirtualTileStride; y++) {
+        int sy = std::min(std::max(tileY * VirtualTileSize + y - VirtualTileBorder, 0), height - 1);
+        const unsigned char* row = image + size_t(sy) * width * 3;
+        for (int x = 0; x < VirtualTileStride; x++) {
+            int sx = ((tileX * VirtualTileSize + x - VirtualTileBorder) % width + width) % width;
+            std::memcpy(tile + (size_t(y) * VirtualTileStride + x) * 3, row + 3 * sx, 3);
+        }
+    }
+}
+
+// Cuts 'source' into tiles, through a temporary file so readers never see
+// a partial one. Levels below 0 are filtered with 'filter'. 'stop' cancels
+// the build.
+inline bool buildVirtualTiles(const std::string& source, uint64_t sourceSize, int64_t sourceTime,
+                              MipFilter filter, const std::atomic<bool>& stop) {
+    auto start = std::chrono::steady_clock::now();
+
+    PPMImage image;
+    {
+        MappedFile file(source.c_str());
+        std::string error;
+        if (!file.isOpen()) {
+            std::cout << "Cannot open file: " << source << std::endl;
+            return false;
+        }
+        if (!parsePPM(file.data, file.size, image, error)) {
+            std::cout << "Error reading " << source << ": " << error << std::endl;
+            return false;
+        }
+    }
+
+    std::vector<VirtualTileLevel> levels = virtualTileLevels(image.width, image.height);
+    if (levels.size() > size_t(VirtualMaxLevels) ||
+        levels[0].tilesX > uint32_t(VirtualMaxPages) || levels[0].tilesY > uint32_t(VirtualMaxPages)) {
+        std::cout << source << " is too large for a virtual texture" << std::endl;
+        return false;
+    }
+
+    VirtualTileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "VTILES\0\0", 8);
+    header.version = VirtualTileVersion;
+    header.tileSize = VirtualTileSize;
+    header.border = VirtualTileBorder;
+    header.levelCount = uint32_t(levels.size());
+    header.sourceSize = sourceSize;
+    header.sourceTime = sourceTime;
+    header.width = uint32_t(image.width);
+    header.height = uint32_t(image.height);
+    header.filter = uint32_t(filter);
+    header.dataOffset = (sizeof(header) + levels.size() * sizeof(VirtualTileLevel) + 63) & ~uint64_t(63);
+
+    std::string filename = virtualTileFilename(source);
+    std::string temp = filename + ".tmp";
+    FILE* fp = fopen(temp.c_str(), "wb");
+    if (fp == NULL) return false;
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(levels.data(), sizeof(VirtualTileLevel), levels.size(), fp) == levels.size();
+    long padding = long(header.dataOffset) - ftell(fp);
+    for (long i = 0; ok && i < padding; i++) ok = fputc(0, fp) != EOF;
+
+    // The levels halve exactly as buildMipLevels() expects, so the whole
+    // pyramid (a third of level 0 on top of it) is built in one pass
+    std::vector<std::vector<unsigned char>> pixels(levels.size());
+    pixels[0] = std::move(image.pixels);
+    std::vector<MipLevelView> views;
+    for (size_t l = 1; l < levels.size(); l++) {
+        pixels[l].resize(size_t(levels[l].width) * levels[l].height * 3);
+        views.push_back({ pixels[l].data(), int(levels[l].width), int(levels[l].height) });
+    }
+    if (ok && !stop) {
+        buildMipLevels(pixels[0].data(), int(levels[0].width), int(levels[0].height), views.data(),
+                       int(views.size()), filter);
+    }
+
+    std::vector<unsigned char> tile(VirtualTileBytes);
+    for (size_t l = 0; ok && l < levels.size() && !stop; l++) {
+        int w = int(levels[l].width), h = int(levels[l].height);
+        for (uint32_t ty = 0; ok && ty < levels[l].tilesY && !stop; ty++) {
+            for (uint32_t tx = 0; ok && tx < levels[l].tilesX; tx++) {
+                extractTile(pixels[l].data(), w, h, int(tx), int(ty), tile.data());
+                ok = fwrite(tile.data(), 1, tile.size(), fp) == tile.size();
+            }
+        }
+    }
+    ok = fclose(fp) == 0 && ok && !stop;
+
+    if (!ok || rename(temp.c_str(), filename.c_str()) != 0) {
+        remove(temp.c_str());
+        return false;
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Cut " << source << " into " << levels.size() << " levels of tiles (" << mipFilterName(filter)
+              << ") in " << ms << " ms" << std::endl;
+    return true;
+}
+
+// Reads the header and level table of an up-to-date tile file built with
+// 'filter'
+inline bool openVirtualTiles(const std::string& source, uint64_t sourceSize, int64_t sourceTime, MipFilter filter,
+                             VirtualTileHeader& header, std::vector<VirtualTileLevel>& levels) {
+    FILE* fp = fopen(virtualTileFilename(source).c_str(), "rb");
+    if (fp == NULL) return false;
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1 &&
+              std::memcmp(header.magic, "VTILES\0\0", 8) == 0 && header.version == VirtualTileVersion &&
+              header.tileSize == uint32_t(VirtualTileSize) && header.border == uint32_t(VirtualTileBorder) &&
+              header.sourceSize == sourceSize && header.sourceTime == sourceTime &&
+              header.filter == uint32_t(filter) && header.levelCount > 0 && header.levelCount <= uint32_t(VirtualMaxLevels);
+    if (ok) {
+        levels.resize(header.levelCount);
+        ok = fread(levels.data(), sizeof(VirtualTileLevel), levels.size(), fp) == levels.size();
+    }
+    fclose(fp);
+    if (!ok) return false;
+
+    // The table must be the one this build would compute
+    std::vector<VirtualTileLevel> expected = virtualTileLevels(int(header.width), int(header.height));
+    return expected.size() == levels.size() &&
+           std::memcmp(expected.data(), levels.data(), levels.size() * sizeof(VirtualTileLevel)) == 0;
+}
+
+//----------------------------------------------------------------------------
+// Streaming
+
+class VirtualTexture {
+public:
+    struct Tile {
+        uint32_t page;
+        int slot;
+        std::vector<unsigned char> texels;  // VirtualTileStride^2 RGB8
+    };
+
+    ~VirtualTexture() { stop(); }
+
+    // Opens the tiles of 'source' (cutting them first if needed) on the
+    // loader thread, filtering levels below 0 with 'filter'; 'slotsPerSide'
+    // squared tiles can be resident at once
+    void start(const std::string& source, int slotsPerSide, MipFilter filter) {
+        this->slotsPerSide = slotsPerSide;
+        slotPage.assign(size_t(slotsPerSide) * slotsPerSide, uint32_t(NoPage));
+        slotLastUsed.assign(slotPage.size(), 0);
+        loader = std::thread(&VirtualTexture::load, this, source, filter);
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (loader.joinable()) loader.join();
+        if (file != NULL) {
+            fclose(file);
+            file = NULL;
+        }
+    }
+
+    // The tile file is open; the accessors below are valid from then on
+    bool ready() const { return isReady; }
+
+    int width() const { return int(header.width); }
+    int height() const { return int(header.height); }
+    int levelCount() const { return int(levels.size()); }
+    const int* pageTableRows() const { return rows.data(); }  // first row of each level
+    int pageTableWidth() const { return int(levels[0].tilesX); }
+    int pageTableHeight() const { return rows.back() + int(levels.back().tilesY); }
+
+    static uint32_t pageKey(int level, int x, int y) {
+        return uint32_t(level) << 20 | uint32_t(y) << 10 | uint32_t(x);
+    }
+
+    // Pages a feedback pass found on screen, as pageKey()s. Those that are
+    // resident, and the coarser tiles covering them, become most recently
+    // used; the missing ones replace the loader's queue, coarsest first so
+    // the fallback sharpens a level at a time.
+    void usePages(const std::vector<uint32_t>& pages) {
+        frame++;
+        std::vector<uint32_t> missing;
+        for (uint32_t page : pages) {
+            int level = int(page >> 20), y = int((page >> 10) & 1023), x = int(page & 1023);
+            for (int l = level; l < levelCount(); l++) {
+                uint32_t key = pageKey(l, x >> (l - level), y >> (l - level));
+                auto slot = residentSlots.find(key);
+                if (slot != residentSlots.end()) {
+                    slotLastUsed[slot->second] = frame;
+                } else {
+                    missing.push_back(key);
+                }
+            }
+        }
+        std::sort(missing.begin(), missing.end(), [](uint32_t a, uint32_t b) { return a > b; });
+        missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+
+        std::lock_guard<std::mutex> lock(mutex);
+        requests.clear();
+        for (uint32_t key : missing) {
+            if (key != inFlight && !loadedPages.count(key)) requests.push_back(key);
+        }
+        if (!requests.empty()) wake.notify_one();
+    }
+
+    // Places up to 'limit' loaded tiles in slots and returns them for upload.
+    // The single top-level tile keeps slot 0; any other tile takes the least
+    // recently used slot, unless every slot was used this frame.
+    void takeTiles(size_t limit, std::vector<Tile>& tiles) {
+        tiles.clear();
+        std::deque<Tile> taken;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            while (!loaded.empty() && taken.size() < limit) {
+                loadedPages.erase(loaded.front().page);
+                taken.push_back(std::move(loaded.front()));
+                loaded.pop_front();
+            }
+        }
+
+        uint32_t topPage = pageKey(levelCount() - 1, 0, 0);
+        for (Tile& tile : taken) {
+            if (residentSlots.count(tile.page)) continue;
+            int slot = 0;
+            if (tile.page != topPage) {
+                slot = 1;
+                for (size_t s = 2; s < slotPage.size(); s++) {
+                    if (slotLastUsed[s] < slotLastUsed[slot]) slot = int(s);
+                }
+                if (slotPage[slot] != NoPage && slotLastUsed[slot] == frame) continue;  // over budget
+            }
+            if (slotPage[slot] != NoPage) residentSlots.erase(slotPage[slot]);
+            slotPage[slot] = tile.page;
+            slotLastUsed[slot] = frame;
+            residentSlots[tile.page] = slot;
+            tile.slot = slot;
+            tiles.push_back(std::move(tile));
+            pageTableDirty = true;
+        }
+    }
+
+    // The page table as RGBA8 texels (atlas slot x, slot y, level, 255), or
+    // NULL when residency has not changed since the last call. Pages with no
+    // tile of their own inherit the entry of the page covering them one
+    // level up; until the top tile arrives everything points at slot 0.
+    const unsigned char* updatedPageTable() {
+        if (!pageTableDirty) return NULL;
+        pageTableDirty = false;
+
+        int tableWidth = pageTableWidth();
+        pageTable.assign(size_t(tableWidth) * pageTableHeight() * 4, 0);
+        int top = levelCount() - 1;
+        for (int l = top; l >= 0; l--) {
+            for (uint32_t y = 0; y < levels[l].tilesY; y++) {
+                for (uint32_t x = 0; x < levels[l].tilesX; x++) {
+                    unsigned char* entry = &pageTable[(size_t(rows[l] + y) * tableWidth + x) * 4];
+                    auto slot = residentSlots.find(pageKey(l, int(x), int(y)));
+                    if (slot != residentSlots.end()) {
+                        entry[0] = static_cast<unsigned char>(slot->second % slotsPerSide);
+                        entry[1] = static_cast<unsigned char>(slot->second / slotsPerSide);
+                        entry[2] = static_cast<unsigned char>(l);
+                    } else if (l == top) {
+                        entry[2] = static_cast<unsigned char>(top);
+                    } else {
+                        uint32_t px = std::min(x / 2, levels[l + 1].tilesX - 1);
+                        uint32_t py = std::min(y / 2, levels[l + 1].tilesY - 1);
+                        std::memcpy(entry, &pageTable[(size_t(rows[l + 1] + py) * tableWidth + px) * 4], 3);
+                    }
+                    entry[3] = 255;
+                }
+            }
+        }
+        return pageTable.data();
+    }
+
+private:
+    static const uint32_t NoPage = ~0u;
+
+    // Loader thread: open the tiles, then read requests until stopped
+    void load(std::string source, MipFilter filter) {
+        TraceProfiler::nameThread("tile loader");
+        uint64_t sourceSize;
+        int64_t sourceTime;
+        if (!fileStat(source, sourceSize, sourceTime)) {
+            std::cout << "Cannot open file: " << source << std::endl;
+            return;
+        }
+        if (!openVirtualTiles(source, sourceSize, sourceTime, filter, header, levels) &&
+            !(buildVirtualTiles(source, sourceSize, sourceTime, filter, stopping) &&
+              openVirtualTiles(source, sourceSize, sourceTime, filter, header, levels))) {
+            return;
+        }
+        file = fopen(virtualTileFilename(source).c_str(), "rb");
+        if (file == NULL) return;
+
+        rows.resize(levels.size());
+        for (size_t l = 0, row = 0; l < levels.size(); row += levels[l].tilesY, l++) rows[l] = int(row);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            requests.push_back(pageKey(levelCount() - 1, 0, 0));
+        }
+        isReady = true;
+
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this] { return stopping || !requests.empty(); });
+            if (stopping) return;
+            inFlight = requests.front();
+            requests.pop_front();
+            lock.unlock();
+
+            Tile tile = { inFlight, -1, std::vector<unsigned char>(VirtualTileBytes) };
+            bool ok = readTile(inFlight, tile.texels.data());
+
+            lock.lock();
+            inFlight = NoPage;
+            if (ok) {
+                loadedPages.insert(tile.page);
+                loaded.push_back(std::move(tile));
+            }
+        }
+    }
+
+    bool readTile(uint32_t page, unsigned char* texels) {
+        TRACE_ZONE("readTile");
+        const VirtualTileLevel& l = levels[page >> 20];
+        uint64_t index = l.firstTile + uint64_t((page >> 10) & 1023) * l.tilesX + (page & 1023);
+        uint64_t offset = header.dataOffset + index * VirtualTileBytes;
+#ifdef _WIN32
+        bool ok = _fseeki64(file, int64_t(offset), SEEK_SET) == 0;
+#else
+        bool ok = fseeko(file, off_t(offset), SEEK_SET) == 0;
+#endif
+        return ok && fread(texels, 1, VirtualTileBytes, file) == VirtualTileBytes;
+    }
+
+    // Written by the loader before isReady, read-only afterwards
+    VirtualTileHeader header;
+    std::vector<VirtualTileLevel> levels;
+    std::vector<int> rows;
+    FILE* file = NULL;
+    std::atomic<bool> isReady{ false };
+
+    // Shared with the loader, under 'mutex'
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<uint32_t> requests;
+    std::deque<Tile> loaded;
+    std::unordered_set<uint32_t> loadedPages;
+    uint32_t inFlight = NoPage;
+    std::atomic<bool> stopping{ false };
+    std::thread loader;
+
+    // Main thread only
+    int slotsPerSide = 0;
+    std::vector<uint32_t> slotPage;
+    std::vector<uint64_t> slotLastUsed;
+    std::unordered_map<uint32_t, int> residentSlots;
+    uint64_t frame = 0;
+    bool pageTableDirty = true;
+    std::vector<unsigned char> pageTable;
+};
+
+#endif
@@ -0,0 +1,312 @@
+#version 410
+
+// Sphere fragment shader, specialized with the same defines as
+// vshader_sphere.glsl, and:
+//   VIRTUAL_TEXTURE  layer VIRTUAL_LAYER is read through the page table and
+//                    tile atlas of the virtual texture instead of 'tex'
+//   FEEDBACK         write the virtual texture page each fragment needs
+//                    (x, y, level) instead of a colour
+//   CLUSTERED        (Phong) add the point lights listed for the fragment's
+//                    cluster of the view volume
+//   DEFERRED         (Phong) write the G-buffer instead of a colour: albedo
+//                    and material to attachment 0, the normal to 1
+//   DEFERRED_LIGHTING
+//                    light each covered pixel from the G-buffer
+
+flat in float textureLayer;
+
+#if DEFERRED_LIGHTING
+flat in mat4 inverseProjection;
+
+uniform sampler2D GBufferAlbedo;  // rgb albedo, a = material index / 255
+uniform sampler2D GBufferNormal;  // eye normal, octahedral
+uniform sampler2D GBufferDepth;
+#elif IMPOSTOR
+// Eye coordinates of the quad and of the sphere it stands for
+in vec3 quadPosition;
+flat in vec3 centre;
+flat in float radius;
+flat in int material;
+
+uniform mat4 ModelView;
+uniform mat4 Projection;
+uniform mat4 Rotation;
+#elif SHADING_PHONG
+in vec2 texCoord;
+// Per-fragment interpolated values from the vertex shader
+in vec3 fN;
+in vec3 fL;
+in vec3 fV;
+flat in int material;
+#else
+in vec2 texCoord;
+in vec4 color;
+#endif
+
+#if TEXTURED
+uniform sampler2DArray tex;
+#endif
+
+#if VIRTUAL_TEXTURE
+// One RGBA8 entry per page of every level (level l starts at row
+// PageTableRow[l]): the atlas slot of the closest resident tile covering
+// the page, and that tile's level
+uniform sampler2D PageTable;
+uniform sampler2D TileAtlas;
+uniform ivec2 VirtualSize;  // level 0, in texels
+uniform int VirtualLevels;
+uniform int PageTableRow[VT_MAX_LEVELS];
+uniform float VirtualLodBias;
+
+const float VT_TILE_STRIDE = float(VT_TILE_SIZE + 2 * VT_TILE_BORDER);
+
+ivec2 virtualLevelSize(int level)
+{
+    return max(VirtualSize >> level, ivec2(1));
+}
+
+// Page (x, y, level) that 'uv' falls in, at the level its footprint
+// dx, dy calls for
+ivec3 virtualPage(vec2 uv, vec2 dx, vec2 dy)
+{
+    vec2 size = vec2(VirtualSize);
+    float footprint = max(length(dx * size), length(dy * size));
+    int level = clamp(int(floor(log2(max(footprint, 1.0)) + VirtualLodBias)), 0, VirtualLevels - 1);
+    ivec2 levelSize = virtualLevelSize(level);
+    ivec2 texel = clamp(ivec2(vec2(fract(uv.s), uv.t) * vec2(levelSize)), ivec2(0), levelSize - 1);
+    return ivec3(texel / VT_TILE_SIZE, level);
+}
+
+// Bilinear lookup in the best resident tile
+vec4 virtualTexture(vec2 uv, vec2 dx, vec2 dy)
+{
+    ivec3 page = virtualPage(uv, dx, dy);
+    vec3 entry = texelFetch(PageTable, ivec2(page.x, PageTableRow[page.z] + page.y), 0).rgb * 255.0;
+    vec2 levelSize = vec2(virtualLevelSize(int(entry.b + 0.5)));
+    vec2 texel = min(vec2(fract(uv.s), uv.t) * levelSize, levelSize - 0.001);
+    vec2 inTile = texel - floor(texel / float(VT_TILE_SIZE)) * float(VT_TILE_SIZE);
+    vec2 atlas = floor(entry.rg + 0.5) * VT_TILE_STRIDE + float(VT_TILE_BORDER) + inTile;
+    return textureLod(TileAtlas, atlas / vec2(textureSize(TileAtlas, 0)), 0.0);
+}
+#endif
+
+#if TEXTURED
+vec4 sampleTexture(vec2 uv, vec2 dx, vec2 dy)
+{
+#if VIRTUAL_TEXTURE
+    if (int(textureLayer + 0.5) == VIRTUAL_LAYER) {
+        return virtualTexture(uv, dx, dy);
+    }
+#endif
+    return textureGrad(tex, vec3(uv, textureLayer), dx, dy);
+}
+#endif
+
+layout(location = 0) out vec4 fcolor;
+#if DEFERRED
+layout(location = 1) out vec2 fnormal;
+#endif
+
+#if DEFERRED || DEFERRED_LIGHTING
+// Octahedral normal encoding: the unit sphere folded onto the square
+// [-1, 1]^2, two half floats per normal
+vec2 octahedronWrap(vec2 v)
+{
+    return (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+vec2 encodeNormal(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    return n.z >= 0.0 ? n.xy : octahedronWrap(n.xy);
+}
+
+vec3 decodeNormal(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if (n.z < 0.0) {
+        n.xy = octahedronWrap(n.xy);
+    }
+    return normalize(n);
+}
+#endif
+
+struct Material {
+    vec4 AmbientProduct, DiffuseProduct, SpecularProduct;
+    float Shininess;
+};
+
+layout(std140) uniform LightingBlock {
+    Material Materials[NUM_MATERIALS];
+    vec4 LightPosition;
+};
+
+#if SHADING_PHONG || IMPOSTOR
+vec4 shade(vec3 N, vec3 L, vec3 V, Material m)
+{
+    vec4 result = vec4(0.0, 0.0, 0.0, 1.0);
+    float NdotL = dot(L, N);
+#if LIGHT_AMBIENT
+    result += m.AmbientProduct;
+#endif
+#if LIGHT_DIFFUSE
+    result += max(NdotL, 0.0) * m.DiffuseProduct;
+#endif
+#if LIGHT_SPECULAR
+    vec3 H = normalize(L + V);
+    float Ks = pow(max(dot(N, H), 0.0), m.Shininess);
+    result += step(0.0, NdotL) * Ks * m.SpecularProduct; // discard the specular highlight if the light's behind the vertex
+#endif
+    result.a = 1.0;
+    return result;
+}
+#endif
+
+#if CLUSTERED
+// Point lights binned on the CPU into clusters: ClusterGrid.xy screen tiles
+// of 1 / ClusterTileScale pixels, each cut into ClusterGrid.z depth slices
+// from eye z ClusterDepth.x, ClusterDepth.y slices per unit
+uniform usamplerBuffer ClusterRanges;  // per cluster: first entry in LightIndices, light count
+uniform usamplerBuffer LightIndices;
+uniform samplerBuffer PointLights;     // per light: eye position and range, colour
+uniform ivec3 ClusterGrid;
+uniform float ClusterTileScale;
+uniform vec2 ClusterDepth;
+
+// Diffuse and specular light of the cluster's point lights at eye position
+// 'pos'. The light fades to nothing at its range.
+vec3 clusteredLights(vec3 pos, vec3 N, vec3 V, Material m)
+{
+    ivec2 tile = min(ivec2(gl_FragCoord.xy * ClusterTileScale), ClusterGrid.xy - 1);
+    int slice = clamp(int((pos.z - ClusterDepth.x) * ClusterDepth.y), 0, ClusterGrid.z - 1);
+    uvec2 range = texelFetch(ClusterRanges, (tile.y * ClusterGrid.x + tile.x) * ClusterGrid.z + slice).rg;
+
+    vec3 result = vec3(0.0);
+    for (uint i = 0u; i < range.y; i++) {
+        int light = int(texelFetch(LightIndices, int(range.x + i)).r);
+        vec4 positionRange = texelFetch(PointLights, 2 * light);
+        vec3 color = texelFetch(PointLights, 2 * light + 1).rgb;
+        vec3 L = positionRange.xyz - pos;
+        float d2 = dot(L, L) / (positionRange.w * positionRange.w);
+        float falloff = max(1.0 - d2, 0.0);
+        falloff *= falloff;
+        L = normalize(L);
+        float NdotL = dot(N, L);
+        vec3 lit = vec3(0.0);
+#if LIGHT_DIFFUSE
+        lit += max(NdotL, 0.0) * m.DiffuseProduct.rgb;
+#endif
+#if LIGHT_SPECULAR
+        vec3 H = normalize(L + V);
+        lit += step(0.0, NdotL) * pow(max(dot(N, H), 0.0), m.Shininess) * m.SpecularProduct.rgb;
+#endif
+        result += falloff * color * lit;
+    }
+    return result;
+}
+#endif
+
+#if IMPOSTOR
+const float PI = 3.14159265;
+#endif
+
+#if DEFERRED_LIGHTING
+// Same lighting as the forward Phong variants, once per covered pixel
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(GBufferDepth, pixel, 0).r;
+    if (depth == 1.0) {
+        discard;  // no sphere here: keep the background
+    }
+    vec4 albedo = texelFetch(GBufferAlbedo, pixel, 0);
+    vec3 N = decodeNormal(texelFetch(GBufferNormal, pixel, 0).rg);
+    vec2 ndc = 2.0 * gl_FragCoord.xy / vec2(textureSize(GBufferDepth, 0)) - 1.0;
+    vec4 eye = inverseProjection * vec4(ndc, 2.0 * depth - 1.0, 1.0);
+    vec3 pos = eye.xyz / eye.w;
+    Material m = Materials[int(albedo.a * 255.0 + 0.5)];
+
+    vec3 V = normalize(-pos);
+    vec4 color = shade(N, normalize(LightPosition.xyz - pos * LightPosition.w), V, m);
+#if CLUSTERED
+    color.rgb += clusteredLights(pos, N, V, m);
+#endif
+    fcolor = vec4(albedo.rgb * color.rgb, 1.0);
+}
+#else
+void main()
+{
+#if IMPOSTOR
+    // The projection is orthographic, so the view ray through this fragment
+    // runs along -z and meets the sphere where the quad lies inside its
+    // outline, at the front of the sphere
+    vec2 offset = quadPosition.xy - centre.xy;
+    float distance2 = dot(offset, offset);
+    vec3 hit = vec3(offset, sqrt(max(radius * radius - distance2, 0.0)));
+    vec3 pos = centre + hit;
+    vec3 fN = hit / radius;
+    vec3 fV = -pos;
+    vec3 fL = LightPosition.xyz - pos * LightPosition.w;
+
+    // Same equirectangular mapping as the mesh, from the normal before
+    // ModelView and Rotation. Derivatives are taken before the discard,
+    // and wrapped so the seam does not select the smallest mip level.
+    vec3 n = normalize(transpose(mat3(ModelView * Rotation)) * fN);
+    vec2 texCoord = vec2(0.5 + atan(n.x, n.z) / (2.0 * PI), 0.5 - asin(n.y) / PI);
+    vec2 texCoordDx = dFdx(texCoord);
+    vec2 texCoordDy = dFdy(texCoord);
+    texCoordDx.s -= round(texCoordDx.s);
+    texCoordDy.s -= round(texCoordDy.s);
+
+    if (distance2 > radius * radius) {
+        discard;
+    }
+    vec4 clip = Projection * vec4(pos, 1.0);
+    gl_FragDepth = 0.5 * clip.z / clip.w + 0.5;  // default depth range
+
+#if !SHADING_PHONG
+    // There are no vertices to light, so Gouraud impostors are lit here too
+    vec4 color = shade(fN, normalize(fL), normalize(fV), Materials[material]);
+#endif
+#else
+    vec2 texCoordDx = dFdx(texCoord);
+    vec2 texCoordDy = dFdy(texCoord);
+#endif
+
+#if FEEDBACK
+    fcolor = vec4(0.0);
+    if (int(textureLayer + 0.5) == VIRTUAL_LAYER) {
+        fcolor = vec4(vec3(virtualPage(texCoord, texCoordDx, texCoordDy)), 255.0) / 255.0;
+    }
+#elif DEFERRED
+    // No lighting here: pixels drawn over later cost only these writes
+#if TEXTURED
+    fcolor = vec4(sampleTexture(texCoord, texCoordDx, texCoordDy).rgb, float(material) / 255.0);
+#else
+    fcolor = vec4(1.0, 1.0, 1.0, float(material) / 255.0);
+#endif
+    fnormal = encodeNormal(normalize(fN));
+#elif SHADING_PHONG
+    // Normalize the input lighting vectors
+    vec3 N = normalize(fN);
+    vec3 V = normalize(fV);
+    vec4 baseColor = shade(N, normalize(fL), V, Materials[material]);
+#if CLUSTERED
+    baseColor.rgb += clusteredLights(-fV, N, V, Materials[material]);
+#endif
+#if TEXTURED
+    fcolor = sampleTexture(texCoord, texCoordDx, texCoordDy) * baseColor;
+#else
+    fcolor = baseColor;
+#endif
+    fcolor.a = 1.0;
+#else
+#if TEXTURED
+    // Gouraud shows the texture unlit
+    fcolor = sampleTexture(texCoord, texCoordDx, texCoordDy);
+#else
+    fcolor = color;
+#endif
+#endif
+}
+#endif
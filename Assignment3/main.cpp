@@ -1,65 +1,274 @@
 // Gouraud (per vertex) shading vs Phong (per fragment) shading of a sphere model
 
 //  Light and material properties are sent to the shader as uniform
-//    variables.  Vertex positions and normals are sent as vertex attributes
+//    variables.  Vertex positions and texture coordinates are sent as vertex
+//    attributes; on the unit sphere the normal is the position itself.
+//    In procedural mode the vertex shader builds the sphere from
+//    gl_VertexID instead, and only the per-instance attributes remain;
+//    impostor mode ray casts each sphere on a single quad
 //
 
 #include "Angel.h"
+#include "ClusteredLights.h"
+#include "FrameTimers.h"
+#include "FrustumCulling.h"
+#include "InitShader.h"
+#include "PPMImage.h"
+#include "SphereCollisions.h"
+#include "TextureCache.h"
+#include "TraceProfiler.h"
+#include "VirtualTexture.h"
 #include <fstream>
 #include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 using namespace std;
 
-const int NumTimesToSubdivide = 5;
-const int NumTriangles        = 4096;  // (4 faces)^(NumTimesToSubdivide + 1)
-const int NumVertices         = 3 * NumTriangles;
+// Level of detail l subdivides the tetrahedron l times: (4 faces)^(l + 1)
+// triangles and, by Euler (V - E + F = 2, E = 3F/2), 2 * 4^l + 2 vertices.
+// All levels live back to back in one vertex buffer and one index buffer.
+const int NumLODs     = 8;  // subdivision levels 0..7
+const int NumIndices  = 12 * ((1 << (2 * NumLODs)) - 1) / 3;            // sum of 3 * 4^(l+1)
+const int NumVertices = 2 * ((1 << (2 * NumLODs)) - 1) / 3 + 2 * NumLODs; // sum of 2 * 4^l + 2
+
+struct SphereLOD {
+    GLint   baseVertex;  // first vertex of this level in the vertex buffer
+    GLuint  firstIndex;  // first index of this level in the index buffer
+    GLsizei indexCount;
+};
+SphereLOD sphereLODs[NumLODs];
+GLuint meshVertexArray = 0;  // built on first use, so the other geometries skip it
+void buildSphereMesh();
+
+// How spheres are drawn, cycled with P:
+//   mesh        the icosphere LODs from the vertex buffer
+//   procedural  the vertex shader generates a UV sphere of Stacks x
+//               2 * Stacks quads from gl_VertexID, with no vertex buffer
+//   impostor    one screen-aligned quad per sphere; the fragment shader
+//               intersects the view ray with the sphere and writes its
+//               depth, so vertex work no longer grows with the sphere's size
+// The last two fetch only the instance attributes.
+enum { GeometryMesh = 0, GeometryProcedural = 1, GeometryImpostor = 2, NumGeometries = 3 };
+const char* geometryNames[NumGeometries] = { "mesh", "procedural", "impostor" };
+int sphereGeometry = GeometryMesh;
+GLuint instanceVertexArray;  // instance attributes only
+
+// LOD selection: aim for triangle edges of about this many pixels, and only
+// switch once the ideal level is this far (in levels) past the boundary
+const float LODTargetEdgePixels = 6.0f;
+const float LODHysteresis = 0.15f;
+int windowWidth = 1024, windowHeight = 1024;
 
 // Texture-related variables
-GLuint textures[2];  // Array to hold texture objects
-int currentTexture = 0;  // Index of current texture
+// All sphere textures are layers of one GL_TEXTURE_2D_ARRAY that stays bound
+// to unit 0; each sphere instance carries the layer it samples. Every
+// layer shares one size, so sources are resampled to it when they are cached.
+const int NumTextureLayers = 2;
+const int TextureLayerWidth = 1024;  // equirectangular, 2:1
+const int TextureLayerHeight = 512;
+GLuint sphereTextures;
+int currentTexture = 0;  // Layer offset applied to every sphere's own layer
+
+// Virtual texturing, toggled with V: one layer is read through a fixed-size
+// cache of tiles instead (see "Virtual texturing" below)
+const char* VirtualTextureFile = "earth.ppm";
+const int VirtualTextureLayer = 1;       // the layer it stands in for
+const int VirtualAtlasSlots = 16;        // per side: 256 resident tiles in 2080 x 2080 RGB8
+const int VirtualFeedbackDivisor = 8;    // feedback pass resolution, per axis
+const size_t VirtualTilesPerFrame = 16;  // upload budget
+bool virtualTexturing = false;
+VirtualTexture virtualTexture;
+GLuint tileAtlasTexture = 0;  // texture unit 2
+GLuint pageTableTexture = 0;  // texture unit 1, created once the tiles are open
 vec2 texCoords[NumVertices];  // Texture coordinates for vertices
 
-// Image-related variables
-int imageWidth, imageHeight;
-unsigned char* imageData;
-
 typedef vec4 point4;
 typedef vec4 color4;
 
 point4 points[NumVertices];
-vec3   normals[NumVertices];
+
+// Vertex buffer layout, interleaved: 12 bytes instead of 36 for a float
+// point4, vec3 normal and vec2 texture coordinate. Every vertex lies on the
+// unit sphere, so normalized shorts keep the position to 1/32767 and w = 1
+// costs nothing, and the shader takes the normal from the position.
+struct SphereVertex {
+    GLshort  position[4];  // normalized, w = 32767
+    GLushort texCoord[2];  // normalized
+};
+GLuint indices[NumIndices];
 
 enum {Xaxis = 0, Yaxis = 1, Zaxis = 2, NumAxes = 3};
 GLfloat Theta[NumAxes] = {0.0, 0.0, 0.0};
 
-// Model-view and projection matrices uniform location
-GLuint  ModelView, Projection, Lighting;
+// Uniform locations, resolved once per program
+struct ProgramUniforms {
+    GLuint program;
+    GLint  modelView;
+    GLint  projection;
+    GLint  rotation;
+    GLint  stacks;  // procedural variants only
+    GLint  virtualSize, virtualLevels, pageTableRows, virtualLodBias;  // virtual texture variants only
+    GLint  clusterGrid, clusterTileScale, clusterDepth;                 // clustered variants only
+};
+
+// Shader permutations: every program is built from vshader_sphere.glsl and
+// fshader_sphere.glsl with #defines for one combination of these bits, so
+// the shaders never branch on shading model, texturing or lighting terms.
+// Variants are submitted to the driver without waiting (all of them at
+// startup when it compiles in parallel, otherwise on first use), finished
+// once the driver reports them ready, and kept.
+enum {
+    VariantPhong    = 1 << 0,  // per-fragment instead of per-vertex lighting
+    VariantTextured = 1 << 1,
+    VariantAmbient  = 1 << 2,
+    VariantDiffuse  = 1 << 3,
+    VariantSpecular = 1 << 4,
+    VariantGeometryShift = 5,    // sphere geometry in the two bits above
+    VariantGeometryMask  = 3 << VariantGeometryShift,
+    VariantVirtual  = 1 << 7,  // the virtual texture layer reads from the tile cache
+    VariantFeedback = 1 << 8,  // writes virtual texture page requests instead of colour
+    VariantClustered = 1 << 9, // Phong only: adds the point lights of each fragment's cluster
+    VariantDeferred = 1 << 10, // Phong only: writes the G-buffer instead of a colour
+    VariantLightingPass = 1 << 11  // the full-screen lighting pass of deferred shading
+};
+std::map<unsigned, ProgramUniforms> shaderVariants;  // finished
+std::map<unsigned, GLuint> pendingVariants;          // submitted, maybe still compiling
+unsigned lastVariant = ~0u;                          // last variant drawn with
+mat4 projection = Ortho( -2.0, 2.0, -2.0, 2.0, -2.0, 2.0 );
+GLfloat viewLeft = -2.0, viewRight = 2.0, viewBottom = -2.0, viewTop = 2.0;  // eye coordinates of the window edges
+
+// Light and material parameters shared by every program through a uniform
+// buffer; the layout matches the std140 LightingBlock in the shaders. Each
+// sphere instance picks one of the materials.
+enum { MaterialPlastic = 0, MaterialMetallic = 1, NumMaterials = 2 };
+struct MaterialProducts {
+    vec4    AmbientProduct;
+    vec4    DiffuseProduct;
+    vec4    SpecularProduct;
+    GLfloat Shininess;
+    GLfloat padding[3];
+};
+struct LightingBlock {
+    MaterialProducts Materials[NumMaterials];
+    vec4    LightPosition;
+};
+const GLuint LightingBindingPoint = 0;
+GLuint lightingBuffer;
+LightingBlock lighting;
+
+// Point lights added to the light above in the Phong variants, cycled with
+// G (see "Clustered lighting" below)
+const int PointLightCounts[] = { 0, 64, 256, 1024 };
+const int NumPointLightCounts = sizeof(PointLightCounts) / sizeof(PointLightCounts[0]);
+int pointLightCountIndex = 0;
 
 GLfloat scaleFactor = 0.3;
 bool fixedLight = true; // true = fixed light, false = moving light
 int textureFlag = 0; // 0 = no texture, 1 = texture, 2 = wireframe
-int textureIndex = 0; // 0 = basketball, 1 = earth
-int materialIndex = 0; // 0 = plastic, 1 = metallic
+int materialIndex = 0; // offset applied to every sphere's material: 0 = as assigned, 1 = swapped
 
 // Bouncing animation variables
-float sphereY = 2.0f / scaleFactor;
-float sphereX = -2.0f / scaleFactor;
-float velocityY = 0.0f;
 float speed = 1.5f;
-float velocityX = 2.0f * speed;
 float gravity = -9.81f * speed;      // Gravity constant
 float groundY = -1.0f;       // Ground level
 float bounceEnergy = 0.7f;   // Energy retention after bounce (0.7 = 70% energy kept)
-float lastTime = 0.0f;       // Last frame time
+double lastTime = 0.0;       // Last frame time
+
+// The simulation advances in fixed steps, independent of the frame rate,
+// so a run is reproducible on any machine. Frame time is banked in an
+// accumulator and spent one step at a time; the remainder becomes the
+// interpolation factor between the last two states when drawing. A long
+// stall is clamped so it cannot trigger a burst of catch-up steps, and if
+// the steps themselves cannot keep up (huge sphere counts) the simulation
+// slows down rather than falling further behind every frame.
+const float PhysicsTimeStep = 1.0f / 120.0f;
+const double MaxFrameTime = 0.25;
+const int MaxStepsPerFrame = 8;
+const float SelfRotationSpeed = 60.0f;  // degrees per second
+const double FastForwardSeconds = 3600.0;
+double physicsAccumulator = 0.0;
+
+// A fast-forward jumps one sphere at a time and spends at most
+// FastForwardBudget seconds a frame on it, so a large scene catches up over
+// several frames instead of blocking input. Spheres [fastForwardNext, end)
+// have yet to jump.
+const double FastForwardBudget = 0.004;
+double fastForwardSeconds = 0.0;  // 0 when no fast-forward is running
+size_t fastForwardNext = 0;
+long fastForwardEvents = 0;
+double fastForwardWork = 0.0;
+
+// Simulated spheres, one array per attribute (structure of arrays) so the
+// update loop streams through memory. Positions are in the unscaled scene
+// units of the original single sphere, which is sphere 0; the others get
+// pseudo-random radii, materials, layers and starting states.
+struct SphereSet {
+    std::vector<float> x, y;
+    std::vector<float> previousX, previousY;  // before the last step, for interpolation
+    std::vector<float> velocityX, velocityY;
+    std::vector<float> radius;
+    std::vector<unsigned char> material;  // index into LightingBlock.Materials
+    std::vector<unsigned char> layer;     // texture array layer
+    std::vector<unsigned char> lod;       // subdivision level it was last drawn with
+    size_t size() const { return x.size(); }
+};
+SphereSet spheres;
+
+const int SphereCounts[] = { 1, 1000, 10000, 100000 };  // cycled with N
+
+// Sphere-sphere collisions. Up to BruteForceMaxSpheres spheres, testing
+// every pair beats sorting for sweep and prune; on the benchmark scene
+// (radii scaled as in setSphereCount) the two cost the same at about 150
+// spheres, and at 10000 sweep and prune is about 90 times faster.
+const size_t BruteForceMaxSpheres = 128;
+bool sphereCollisions = true;
+SweepAndPrune broadPhase;
+std::vector<SpherePair> collidingPairs;
+const int NumSphereCounts = sizeof(SphereCounts) / sizeof(SphereCounts[0]);
+int sphereCountIndex = 0;
+
+// Per-instance vertex data, rebuilt every frame for the spheres in view
+// (frustum culling, toggled with X) and grouped by LOD
+struct SphereInstance {
+    GLfloat x, y, radius;
+    GLfloat layer, material;
+};
+bool frustumCulling = true;
+std::vector<uint32_t> visibleSpheres;
+std::vector<SphereInstance> instanceData;
+GLuint instanceBuffer;
+int sphereGroupStart[NumLODs], sphereGroupSize[NumLODs];  // instances of each LOD
+
+// Frame time statistics, printed every few seconds with more than one sphere
+const double FrameReportInterval = 2.0;
+int framesSinceReport = 0;
+double frameTimeSum = 0.0, simulationTimeSum = 0.0;
+double lastReportTime = 0.0;
+
+// Timed phases of a frame (F1 shows the timings, F2 saves them)
+enum { PhaseUploads, PhaseSimulation, PhaseLights, PhaseInstances, PhaseSpheres, PhaseFeedback };
+FrameTimers frameTimers({ "uploads", "simulation", "lights", "instances", "spheres", "feedback" });
+const char* frameTimesFile = "frame_times.csv";
+const char* traceFile = "trace.json";  // F3; TRACE_FILE=<file> traces the whole run
 
-float tempVelocityX, tempVelocityY;
 bool paused = false;
 bool selfRotate = false;
 
-// Add shader program variables
-GLuint gouraudProgram, phongProgram;
 bool usePhongShader = false; // false = gouraud, true = phong
-int mode = 0;
+bool depthPrepass = false; // lay down depth first, so forward shading runs once per pixel
+bool useDeferredShading = false; // Phong lighting in a full-screen pass after a G-buffer pass; overrides usePhongShader
+int mode = 0; // 0 = all terms, 1 = no ambient, 2 = no diffuse, 3 = no specular
 
 point4 light_position;
 color4 light_ambient;
@@ -77,7 +286,12 @@ color4 specular_product;
 
 //----------------------------------------------------------------------------
 
-int Index = 0;
+int Index = 0;        // Next free slot in indices[]
+int VertexCount = 0;  // Next free slot in points[]/texCoords[]
+
+// Midpoint cache: an edge (lower index, higher index) maps to the vertex that
+// was created on it, so neighbouring triangles share the same vertex
+std::unordered_map<uint64_t, GLuint> edgeMidpoints;
 
 // Function to calculate texture coordinates for a point on sphere
 vec2 calculateTexCoords(const point4& p) {
@@ -86,17 +300,48 @@ vec2 calculateTexCoords(const point4& p) {
     return vec2(s, t);
 }
 
+GLuint
+addVertex( const point4& p )
+{
+    points[VertexCount] = p;  texCoords[VertexCount] = calculateTexCoords(p);
+    return VertexCount++;
+}
+
+GLshort
+packSigned( float v )
+{
+    return GLshort( roundf( std::max(-1.0f, std::min(v, 1.0f)) * 32767.0f ) );
+}
+
+GLushort
+packUnsigned( float v )
+{
+    return GLushort( roundf( std::max(0.0f, std::min(v, 1.0f)) * 65535.0f ) );
+}
+
+// Packs the generated mesh into the vertex buffer layout
+std::vector<SphereVertex>
+packVertices()
+{
+    std::vector<SphereVertex> vertices( VertexCount );
+    for ( int i = 0; i < VertexCount; i++ ) {
+        SphereVertex& v = vertices[i];
+        v.position[0] = packSigned( points[i].x );
+        v.position[1] = packSigned( points[i].y );
+        v.position[2] = packSigned( points[i].z );
+        v.position[3] = 32767;
+        v.texCoord[0] = packUnsigned( texCoords[i].x );
+        v.texCoord[1] = packUnsigned( texCoords[i].y );
+    }
+    return vertices;
+}
+
 void
-triangle( const point4& a, const point4& b, const point4& c )
+triangle( GLuint a, GLuint b, GLuint c )
 {
-    //normal vector is computed per vertex
-    
-    vec3 norm = normalize(vec3 (a.x,a.y,a.z));
-    normals[Index] = vec3(norm.x, norm.y, norm.z);  points[Index] = a;  texCoords[Index] = calculateTexCoords(a);  Index++;
-    norm = normalize(vec3 (b.x,b.y,b.z));
-    normals[Index] = vec3(norm.x, norm.y, norm.z);   points[Index] = b;  texCoords[Index] = calculateTexCoords(b);  Index++;
-    norm = normalize(vec3 (c.x,c.y,c.z));
-    normals[Index] = vec3(norm.x, norm.y, norm.z);   points[Index] = c;  texCoords[Index] = calculateTexCoords(c);  Index++;
+    indices[Index++] = a;
+    indices[Index++] = b;
+    indices[Index++] = c;
 }
 //----------------------------------------------------------------------------
 
@@ -104,24 +349,37 @@ point4
 unit( const point4& p )
 {
     float len = p.x*p.x + p.y*p.y + p.z*p.z;
-    
+
     point4 t;
     if ( len > DivideByZeroTolerance ) {
         t = p / sqrt(len);
         t.w = 1.0;
     }
-    
+
     return t;
 }
 
+// Returns the (welded) vertex halfway along edge a-b, creating it on first use
+GLuint
+midpoint( GLuint a, GLuint b )
+{
+    uint64_t key = a < b ? (uint64_t(a) << 32) | b : (uint64_t(b) << 32) | a;
+    auto it = edgeMidpoints.find(key);
+    if ( it != edgeMidpoints.end() ) {
+        return it->second;
+    }
+    GLuint v = addVertex( unit( points[a] + points[b] ) );
+    edgeMidpoints[key] = v;
+    return v;
+}
+
 void
-divide_triangle( const point4& a, const point4& b,
-                const point4& c, int count )
+divide_triangle( GLuint a, GLuint b, GLuint c, int count )
 {
     if ( count > 0 ) {
-        point4 v1 = unit( a + b );
-        point4 v2 = unit( a + c );
-        point4 v3 = unit( b + c );
+        GLuint v1 = midpoint( a, b );
+        GLuint v2 = midpoint( a, c );
+        GLuint v3 = midpoint( b, c );
         divide_triangle(  a, v1, v2, count - 1 );
         divide_triangle(  c, v2, v3, count - 1 );
         divide_triangle(  b, v3, v1, count - 1 );
@@ -132,121 +390,320 @@ divide_triangle( const point4& a, const point4& b,
     }
 }
 
+//----------------------------------------------------------------------------
+// Post-transform vertex cache optimization ("Tipsify", Sander et al. 2007).
+// Reorders triangles so recently transformed vertices are reused while they
+// are still in the GPU's post-transform cache, then renumbers the vertices in
+// first-use order so vertex fetches walk the buffer linearly.
+
+const int VertexCacheSize = 16;
+
+GLuint
+skipDeadEnd( const std::vector<int>& liveTriangles, std::vector<GLuint>& deadEnd,
+             int& cursor, int vertexCount )
+{
+    // Prefer a recently used vertex that still has unemitted triangles
+    while ( !deadEnd.empty() ) {
+        GLuint d = deadEnd.back();
+        deadEnd.pop_back();
+        if ( liveTriangles[d] > 0 ) return d;
+    }
+    // Otherwise continue with the next vertex in input order
+    while ( cursor < vertexCount ) {
+        if ( liveTriangles[cursor] > 0 ) return cursor++;
+        cursor++;
+    }
+    return GLuint(-1);
+}
+
+// idx holds indices relative to baseVertex
+void
+optimizeVertexCache( GLuint* idx, int indexCount, int baseVertex, int vertexCount )
+{
+    int triangleCount = indexCount / 3;
+
+    // Vertex -> triangle adjacency in CSR form
+    std::vector<int> liveTriangles(vertexCount, 0);
+    for ( int i = 0; i < indexCount; i++ ) liveTriangles[idx[i]]++;
+
+    std::vector<int> offsets(vertexCount + 1, 0);
+    for ( int v = 0; v < vertexCount; v++ ) offsets[v + 1] = offsets[v] + liveTriangles[v];
+
+    std::vector<int> adjacency(indexCount);
+    std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+    for ( int i = 0; i < indexCount; i++ ) adjacency[fill[idx[i]]++] = i / 3;
+
+    std::vector<int> cacheTime(vertexCount, 0);
+    std::vector<bool> emitted(triangleCount, false);
+    std::vector<GLuint> deadEnd;
+    std::vector<GLuint> candidates;
+    std::vector<GLuint> output;
+    output.reserve(indexCount);
+
+    int timeStamp = VertexCacheSize + 1;
+    int cursor = 1;
+    GLuint fanning = 0;
+
+    while ( fanning != GLuint(-1) ) {
+        candidates.clear();
+
+        // Emit every remaining triangle around the fanning vertex
+        for ( int k = offsets[fanning]; k < offsets[fanning + 1]; k++ ) {
+            int t = adjacency[k];
+            if ( emitted[t] ) continue;
+
+            for ( int j = 0; j < 3; j++ ) {
+                GLuint v = idx[3 * t + j];
+                output.push_back(v);
+                deadEnd.push_back(v);
+                candidates.push_back(v);
+                liveTriangles[v]--;
+                if ( timeStamp - cacheTime[v] > VertexCacheSize ) {
+                    cacheTime[v] = timeStamp++;
+                }
+            }
+            emitted[t] = true;
+        }
+
+        // Next fanning vertex: the candidate that will still be in the cache
+        // after its remaining triangles are emitted, oldest first
+        GLuint next = GLuint(-1);
+        int best = -1;
+        for ( GLuint v : candidates ) {
+            if ( liveTriangles[v] <= 0 ) continue;
+            int priority = 0;
+            if ( timeStamp - cacheTime[v] + 2 * liveTriangles[v] <= VertexCacheSize ) {
+                priority = timeStamp - cacheTime[v];
+            }
+            if ( priority > best ) {
+                best = priority;
+                next = v;
+            }
+        }
+        if ( next == GLuint(-1) ) {
+            next = skipDeadEnd( liveTriangles, deadEnd, cursor, vertexCount );
+        }
+        fanning = next;
+    }
+
+    // Renumber vertices in first-use order
+    std::vector<GLuint> remap(vertexCount, GLuint(-1));
+    point4* levelPoints = points + baseVertex;
+    vec2*   levelTexCoords = texCoords + baseVertex;
+    std::vector<point4> oldPoints(levelPoints, levelPoints + vertexCount);
+    std::vector<vec2>   oldTexCoords(levelTexCoords, levelTexCoords + vertexCount);
+    GLuint nextVertex = 0;
+    for ( int i = 0; i < indexCount; i++ ) {
+        GLuint v = output[i];
+        if ( remap[v] == GLuint(-1) ) {
+            remap[v] = nextVertex;
+            levelPoints[nextVertex] = oldPoints[v];
+            levelTexCoords[nextVertex] = oldTexCoords[v];
+            nextVertex++;
+        }
+        idx[i] = remap[v];
+    }
+}
+
+// Appends subdivision level 'count' to the shared buffers
 void
 tetrahedron( int count )
 {
+    int baseVertex = VertexCount;
+    int firstIndex = Index;
+
     point4 v[4] = {
         vec4( 0.0, 0.0, 1.0, 1.0 ),
         vec4( 0.0, 0.942809, -0.333333, 1.0 ),
         vec4( -0.816497, -0.471405, -0.333333, 1.0 ),
         vec4( 0.816497, -0.471405, -0.333333, 1.0 )
     };
-    
-    divide_triangle( v[0], v[1], v[2], count );
-    divide_triangle( v[3], v[2], v[1], count );
-    divide_triangle( v[0], v[3], v[1], count );
-    divide_triangle( v[0], v[2], v[3], count );
-}
 
-//----------------------------------------------------------------------------
-// Function to skip comments in PPM file
-void ignoreComments(std::ifstream& file) {
-    char c;
-    while (file.get(c)) {
-        if (c == '#') {
-            while (file.get(c) && c != '\n');
-        } else {
-            file.unget();
-            break;
-        }
+    GLuint corners[4];
+    for ( int i = 0; i < 4; i++ ) {
+        corners[i] = addVertex( v[i] );
     }
+
+    divide_triangle( corners[0], corners[1], corners[2], count );
+    divide_triangle( corners[3], corners[2], corners[1], count );
+    divide_triangle( corners[0], corners[3], corners[1], count );
+    divide_triangle( corners[0], corners[2], corners[3], count );
+
+    edgeMidpoints.clear();
+
+    // Store indices relative to the level so it can be drawn with a base vertex
+    for ( int i = firstIndex; i < Index; i++ ) {
+        indices[i] -= baseVertex;
+    }
+    optimizeVertexCache( indices + firstIndex, Index - firstIndex, baseVertex, VertexCount - baseVertex );
+
+    sphereLODs[count].baseVertex = baseVertex;
+    sphereLODs[count].firstIndex = firstIndex;
+    sphereLODs[count].indexCount = Index - firstIndex;
 }
 
-// Function to read PPM image
-bool readPPMImage(const std::string& filename) {
-    std::ifstream file(filename.c_str(), std::ios::binary);
-    if (!file.is_open()) {
-        std::cout << "Cannot open file: " << filename << std::endl;
-        return false;
+// Picks the subdivision level for a sphere 'radiusPixels' in radius that
+// was last drawn at 'level'
+int
+selectLOD( float radiusPixels, int level )
+{
+    // Edge length of level l on the unit sphere is about 1.633 / 2^l
+    float ideal = log2f( std::max(radiusPixels * 1.633f / LODTargetEdgePixels, 1.0f) );
+
+    if ( ideal > level + LODHysteresis ) {
+        return std::min( int(ceilf(ideal)), NumLODs - 1 );
+    }
+    if ( ideal < level - 1 - LODHysteresis ) {
+        return std::max( int(ceilf(ideal)), 0 );
     }
-    std::cout << "Successfully opened file: " << filename << std::endl;
+    return level;
+}
 
-    // Read magic number
-    std::string magic;
-    ignoreComments(file);
-    file >> magic;
-    
-    // Read dimensions
-    ignoreComments(file);
-    file >> imageWidth;
-    
-    ignoreComments(file);
-    file >> imageHeight;
-    
-    ignoreComments(file);
-    int maxValue;
-    file >> maxValue;
-    
-    // Calculate data size
-    int dataSize = imageWidth * imageHeight * 3;
-
-    // Allocate memory for image data
-    imageData = new unsigned char[dataSize];
-
-    int value;
-    for (int i = 0; i < dataSize; i++) {
-        file >> value;
-        if (file.fail()) {
-            std::cout << "Error reading ASCII data at position " << i << std::endl;
-            delete[] imageData;
-            file.close();
-            return false;
+// UV sphere resolution for 'level': as many stacks as keep the equator's
+// edges as long as that level's icosphere edges (pi / stacks = 1.633 / 2^l)
+int
+proceduralStacks( int level )
+{
+    return std::max( int(ceilf(1.924f * (1 << level))), 3 );
+}
+
+//----------------------------------------------------------------------------
+// Asynchronous texture loading
+//
+// A loader thread fetches each texture's precomputed mip chain (mapping the
+// .mipcache file, or decoding the PPM and building it on first use) while
+// the sphere is drawn with a placeholder texture. Each frame the main thread
+// copies a bounded slice of a chain into a mapped pixel buffer object; once
+// the whole chain is in the PBO, every level is sourced from there so the
+// transfer to the GPU does not block the CPU.
+
+const char* textureFiles[NumTextureLayers] = { "basketball.ppm", "earth.ppm" };
+const MipFilter TextureMipFilter = MipFilterKaiser;  // for every level below 0
+const size_t UploadBytesPerFrame = 8 << 20;  // main-thread copy budget
+
+struct TextureUpload {
+    int layer;
+    MipChain chain;
+    GLuint pbo;
+    unsigned char* mapped;
+    size_t copied;
+};
+
+std::mutex decodedMutex;
+std::deque<TextureUpload> decodedTextures;  // filled by the loader thread
+std::deque<TextureUpload> pendingUploads;   // main thread only
+std::thread textureLoader;
+std::atomic<bool> stopTextureLoading(false);
+
+void loadTexturesAsync() {
+    TraceProfiler::nameThread("texture loader");
+    for (int i = 0; i < NumTextureLayers && !stopTextureLoading; i++) {
+        TextureUpload upload = { i, MipChain(), 0, NULL, 0 };
+        if (loadTextureCached(textureFiles[i], TextureLayerWidth, TextureLayerHeight, TextureMipFilter,
+                              upload.chain)) {
+            std::lock_guard<std::mutex> lock(decodedMutex);
+            decodedTextures.push_back(std::move(upload));
         }
-        imageData[i] = static_cast<unsigned char>(value);
     }
+}
 
-    
-    if (file.fail()) {
-        std::cout << "Error reading image data" << std::endl;
-        std::cout << "Bytes read: " << file.gcount() << std::endl;
-        delete[] imageData;
-        file.close();
-        return false;
+void stopTextureLoader() {
+    stopTextureLoading = true;
+    if (textureLoader.joinable()) {
+        textureLoader.join();
     }
-
-    std::cout << "Successfully read image data" << std::endl;
-    file.close();
-    return true;
 }
 
-// Function to setup texture
-void setupTexture() {
-    glGenTextures(2, textures);  // Generate 2 texture IDs
+// Allocates the texture array with every layer a grey placeholder, binds it
+// for good and starts the loader
+void setupTextures() {
+    glGenTextures(1, &sphereTextures);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, sphereTextures);
+
+    int levelCount = mipLevelCount(TextureLayerWidth, TextureLayerHeight);
+    std::vector<unsigned char> placeholder(size_t(TextureLayerWidth) * TextureLayerHeight * 3 * NumTextureLayers, 128);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);  // PPM rows are tightly packed RGB
+    int w = TextureLayerWidth, h = TextureLayerHeight;
+    for (int level = 0; level < levelCount; level++) {
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, level, GL_RGB8, w, h, NumTextureLayers, 0,
+                     GL_RGB, GL_UNSIGNED_BYTE, placeholder.data());
+        w = std::max(w / 2, 1);
+        h = std::max(h / 2, 1);
+    }
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, levelCount - 1);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    textureLoader = std::thread(loadTexturesAsync);
+    atexit(stopTextureLoader);
+}
 
-    glBindTexture(GL_TEXTURE_2D, textures[0]);
+// Called once per frame: moves decoded images into PBOs and, once complete,
+// into their texture objects
+void pollTextureUploads() {
+    {
+        std::lock_guard<std::mutex> lock(decodedMutex);
+        while (!decodedTextures.empty()) {
+            pendingUploads.push_back(std::move(decodedTextures.front()));
+            decodedTextures.pop_front();
+        }
+    }
 
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, imageWidth, imageHeight, 0, 
-                 GL_RGB, GL_UNSIGNED_BYTE, imageData);
+    size_t budget = UploadBytesPerFrame;
+    while (!pendingUploads.empty() && budget > 0) {
+        TextureUpload& upload = pendingUploads.front();
+        const MipChain& chain = upload.chain;
+        size_t size = chain.dataSize;
 
-    glGenerateMipmap(GL_TEXTURE_2D);
+        if (upload.pbo == 0) {
+            glGenBuffers(1, &upload.pbo);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload.pbo);
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+        } else {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload.pbo);
+        }
+        if (upload.mapped == NULL) {
+            upload.mapped = static_cast<unsigned char*>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+                GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+            upload.copied = 0;
+            if (upload.mapped == NULL) {
+                std::cout << "Failed to map upload buffer for " << textureFiles[upload.layer] << std::endl;
+                glDeleteBuffers(1, &upload.pbo);
+                pendingUploads.pop_front();
+                continue;
+            }
+        }
 
-    // Setup first texture
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        size_t chunk = std::min(budget, size - upload.copied);
+        memcpy(upload.mapped + upload.copied, chain.data + upload.copied, chunk);
+        upload.copied += chunk;
+        budget -= chunk;
+        if (upload.copied < size) {
+            break;  // continue next frame
+        }
 
-    // Free the image data after uploading to GPU
-    delete[] imageData;
+        upload.mapped = NULL;
+        if (glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) == GL_FALSE) {
+            continue;  // buffer contents were lost, copy again
+        }
 
-    // Setup second texture (you'll need to load another PPM file here)
-    // For now, we'll just set up the parameters
-    glBindTexture(GL_TEXTURE_2D, textures[1]);
+        // The PBO holds the chain exactly as laid out in the cache file; the
+        // array stays bound to unit 0, so no bind is needed
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        for (size_t level = 0; level < chain.levels.size(); level++) {
+            const MipCacheLevel& l = chain.levels[level];
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, GLint(level), 0, 0, upload.layer, l.width, l.height, 1,
+                            GL_RGB, GL_UNSIGNED_BYTE, BUFFER_OFFSET(l.offset));
+        }
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        // The driver keeps the storage alive until the copy has finished
+        glDeleteBuffers(1, &upload.pbo);
+        pendingUploads.pop_front();
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 }
 
 void plasticMaterial(){
@@ -283,90 +740,1053 @@ void metallicMaterial(){
     specular_product = light_specular * material_specular;
 }
 
+ProgramUniforms resolveUniforms(GLuint program){
+    ProgramUniforms u;
+    u.program = program;
+    u.modelView = glGetUniformLocation(program, "ModelView");
+    u.projection = glGetUniformLocation(program, "Projection");
+    u.rotation = glGetUniformLocation(program, "Rotation");
+    u.stacks = glGetUniformLocation(program, "Stacks");
+    u.virtualSize = glGetUniformLocation(program, "VirtualSize");
+    u.virtualLevels = glGetUniformLocation(program, "VirtualLevels");
+    u.pageTableRows = glGetUniformLocation(program, "PageTableRow");
+    u.virtualLodBias = glGetUniformLocation(program, "VirtualLodBias");
+    u.clusterGrid = glGetUniformLocation(program, "ClusterGrid");
+    u.clusterTileScale = glGetUniformLocation(program, "ClusterTileScale");
+    u.clusterDepth = glGetUniformLocation(program, "ClusterDepth");
+
+    GLuint block = glGetUniformBlockIndex(program, "LightingBlock");
+    if (block != GL_INVALID_INDEX) {
+        glUniformBlockBinding(program, block, LightingBindingPoint);
+    }
+    return u;
+}
+
+// The texture array lives on unit 0, the virtual texture's page table and
+// tile atlas on units 1 and 2, the clustered light lists on units 3 to 5
+// and the deferred G-buffer on units 6 to 8
+void setSamplerUnits(GLuint program){
+    glUniform1i(glGetUniformLocation(program, "tex"), 0);
+    glUniform1i(glGetUniformLocation(program, "PageTable"), 1);
+    glUniform1i(glGetUniformLocation(program, "TileAtlas"), 2);
+    glUniform1i(glGetUniformLocation(program, "ClusterRanges"), 3);
+    glUniform1i(glGetUniformLocation(program, "LightIndices"), 4);
+    glUniform1i(glGetUniformLocation(program, "PointLights"), 5);
+    glUniform1i(glGetUniformLocation(program, "GBufferAlbedo"), 6);
+    glUniform1i(glGetUniformLocation(program, "GBufferNormal"), 7);
+    glUniform1i(glGetUniformLocation(program, "GBufferDepth"), 8);
+}
+
+// Lighting terms and lights of the current key state
+unsigned lightingVariantBits(){
+    unsigned variant = 0;
+    if (mode != 1) variant |= VariantAmbient;
+    if (mode != 2) variant |= VariantDiffuse;
+    if (mode != 3) variant |= VariantSpecular;
+    if (PointLightCounts[pointLightCountIndex] > 0) variant |= VariantClustered;
+    return variant;
+}
+
+// Permutation bits for the current key state. With deferred shading this
+// is the G-buffer pass, which does no lighting; the lighting is in
+// lightingPassVariant().
+unsigned currentVariant(){
+    unsigned variant = 0;
+    if (useDeferredShading) {
+        variant |= VariantPhong | VariantDeferred;
+    } else if (usePhongShader) {
+        variant |= VariantPhong | lightingVariantBits();
+    } else {
+        variant |= lightingVariantBits() & ~VariantClustered;
+    }
+    if (textureFlag == 1) variant |= VariantTextured;
+    variant |= sphereGeometry << VariantGeometryShift;
+    if (virtualTexturing && pageTableTexture != 0) variant |= VariantVirtual;
+    return variant;
+}
+
+unsigned lightingPassVariant(){
+    return VariantPhong | VariantLightingPass | lightingVariantBits();
+}
+
+void submitShaderVariant(unsigned variant){
+    if (shaderVariants.count(variant) || pendingVariants.count(variant)) {
+        return;
+    }
+    unsigned geometry = (variant & VariantGeometryMask) >> VariantGeometryShift;
+    std::string defines =
+        "#define NUM_MATERIALS "  + std::to_string(int(NumMaterials)) + "\n" +
+        "#define SHADING_PHONG "  + std::to_string((variant & VariantPhong) ? 1 : 0) + "\n" +
+        "#define TEXTURED "       + std::to_string((variant & VariantTextured) ? 1 : 0) + "\n" +
+        "#define LIGHT_AMBIENT "  + std::to_string((variant & VariantAmbient) ? 1 : 0) + "\n" +
+        "#define LIGHT_DIFFUSE "  + std::to_string((variant & VariantDiffuse) ? 1 : 0) + "\n" +
+        "#define LIGHT_SPECULAR " + std::to_string((variant & VariantSpecular) ? 1 : 0) + "\n" +
+        "#define PROCEDURAL "     + std::to_string(geometry == GeometryProcedural ? 1 : 0) + "\n" +
+        "#define IMPOSTOR "       + std::to_string(geometry == GeometryImpostor ? 1 : 0) + "\n" +
+        "#define VIRTUAL_TEXTURE " + std::to_string((variant & VariantVirtual) ? 1 : 0) + "\n" +
+        "#define FEEDBACK "       + std::to_string((variant & VariantFeedback) ? 1 : 0) + "\n" +
+        "#define CLUSTERED "      + std::to_string((variant & VariantClustered) ? 1 : 0) + "\n" +
+        "#define DEFERRED "       + std::to_string((variant & VariantDeferred) ? 1 : 0) + "\n" +
+        "#define DEFERRED_LIGHTING " + std::to_string((variant & VariantLightingPass) ? 1 : 0) + "\n" +
+        "#define VIRTUAL_LAYER "  + std::to_string(VirtualTextureLayer) + "\n" +
+        "#define VT_TILE_SIZE "   + std::to_string(VirtualTileSize) + "\n" +
+        "#define VT_TILE_BORDER " + std::to_string(VirtualTileBorder) + "\n" +
+        "#define VT_MAX_LEVELS "  + std::to_string(VirtualMaxLevels) + "\n";
+    pendingVariants[variant] = SubmitShader( "vshader_sphere.glsl", "fshader_sphere.glsl", defines.c_str() );
+}
+
+const ProgramUniforms& finishShaderVariant(unsigned variant){
+    GLuint program = pendingVariants[variant];
+    pendingVariants.erase(variant);
+    FinishShader(program);
+
+    ProgramUniforms u = resolveUniforms(program);
+    glUseProgram(program);
+    glUniformMatrix4fv( u.projection, 1, GL_TRUE, projection );
+    setSamplerUnits(program);
+
+    return shaderVariants[variant] = u;
+}
+
+// Finishes whichever submitted variants the driver has completed; only
+// useful (and only non-blocking) with parallel compilation
+void pollShaderVariants(){
+    if (!ParallelShaderCompile()) {
+        return;
+    }
+    std::vector<unsigned> ready;
+    for (const auto& pending : pendingVariants) {
+        if (ShaderReady(pending.second)) {
+            ready.push_back(pending.first);
+        }
+    }
+    for (unsigned variant : ready) {
+        finishShaderVariant(variant);
+    }
+}
+
+// Program for 'variant'. If it is still compiling, the previously drawn
+// variant stands in for it rather than stalling the frame, as long as it
+// draws the same sphere geometry into the same kind of target.
+const ProgramUniforms& getShaderVariant(unsigned variant){
+    auto it = shaderVariants.find(variant);
+    if (it == shaderVariants.end()) {
+        submitShaderVariant(variant);
+        auto previous = shaderVariants.find(lastVariant);
+        bool compatible = ((lastVariant ^ variant) & (VariantGeometryMask | VariantDeferred)) == 0;
+        if (!ShaderReady(pendingVariants[variant]) && previous != shaderVariants.end() && compatible) {
+            return previous->second;
+        }
+        finishShaderVariant(variant);
+        it = shaderVariants.find(variant);
+    }
+    lastVariant = variant;
+    return it->second;
+}
+
+// A shader file was edited: the rebuilt program takes over its variant
+void shaderReloaded(GLuint oldProgram, GLuint newProgram){
+    for (auto& entry : shaderVariants) {
+        if (entry.second.program != oldProgram) {
+            continue;
+        }
+        ProgramUniforms u = resolveUniforms(newProgram);
+        GLint current = 0;
+        glGetIntegerv(GL_CURRENT_PROGRAM, &current);
+        glUseProgram(newProgram);
+        glUniformMatrix4fv( u.projection, 1, GL_TRUE, projection );
+        setSamplerUnits(newProgram);
+        glUseProgram(current);
+        entry.second = u;
+    }
+}
+
+void setupUniforms(){
+    glGenBuffers(1, &lightingBuffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, lightingBuffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(LightingBlock), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, LightingBindingPoint, lightingBuffer);
+
+    // With driver threads available, queue every lighting permutation of
+    // the startup geometry now so they compile while the first frames are
+    // drawn; only the startup configuration is waited for
+    if (ParallelShaderCompile()) {
+        unsigned startup = currentVariant() & ~((1u << VariantGeometryShift) - 1);
+        for (unsigned variant = 0; variant < (1u << VariantGeometryShift); variant++) {
+            submitShaderVariant(variant | startup);
+        }
+    }
+    glUseProgram(getShaderVariant(currentVariant()).program);
+
+    // Edits to the shader files are picked up without a restart
+    WatchShaders();
+}
+
+void storeMaterial(MaterialProducts& m){
+    m.AmbientProduct = ambient_product;
+    m.DiffuseProduct = diffuse_product;
+    m.SpecularProduct = specular_product;
+    m.Shininess = material_shininess;
+}
+
+// One buffer update covers every material and program
 void setupMaterial(){
-    // Set uniforms for both shader programs
-    for (GLuint program : {gouraudProgram, phongProgram}) {
-        glUseProgram(program);
-        glUniform4fv( glGetUniformLocation(program, "AmbientProduct"), 1, ambient_product );
-        glUniform4fv( glGetUniformLocation(program, "DiffuseProduct"), 1, diffuse_product );
-        glUniform4fv( glGetUniformLocation(program, "SpecularProduct"), 1, specular_product );
-        glUniform4fv( glGetUniformLocation(program, "LightPosition"), 1, light_position );
-        glUniform1f( glGetUniformLocation(program, "Shininess"), material_shininess );
-        
-        // Set TextureFlag uniform
-        glUniform1i(glGetUniformLocation(program, "TextureFlag"), 0); // Initially set to 0 (no texture)
-        
-        // Get transformation uniform locations
-        ModelView = glGetUniformLocation( program, "ModelView" );
-        Projection = glGetUniformLocation( program, "Projection" );
-        
-        mat4 projection = Ortho( -2.0, 2.0, -2.0, 2.0, -2.0, 2.0 );
-        glUniformMatrix4fv( Projection, 1, GL_TRUE, projection );
+    plasticMaterial();
+    storeMaterial(lighting.Materials[MaterialPlastic]);
+    metallicMaterial();
+    storeMaterial(lighting.Materials[MaterialMetallic]);
+    lighting.LightPosition = light_position;
+
+    glBindBuffer(GL_UNIFORM_BUFFER, lightingBuffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(LightingBlock), &lighting);
+}
+
+void setLightPosition(const point4& position){
+    light_position = position;
+    if (position.x == lighting.LightPosition.x && position.y == lighting.LightPosition.y &&
+        position.z == lighting.LightPosition.z && position.w == lighting.LightPosition.w) {
+        return;
     }
+    lighting.LightPosition = position;
+    glBindBuffer(GL_UNIFORM_BUFFER, lightingBuffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, offsetof(LightingBlock, LightPosition), sizeof(vec4), &lighting.LightPosition);
 }
 
 
-// OpenGL initialization
+//----------------------------------------------------------------------------
+// Sphere simulation
+
+// Deterministic pseudo-random number in [0, 1) for sphere i
+float sphereRandom(size_t i, unsigned salt) {
+    uint32_t h = uint32_t(i) * 0x9E3779B1u ^ salt * 0x85EBCA77u;
+    h ^= h >> 15; h *= 0x2C1B3C6Du;
+    h ^= h >> 12; h *= 0x297A2D39u;
+    h ^= h >> 15;
+    return (h >> 8) * (1.0f / 16777216.0f);
+}
+
+// Puts sphere i at its starting state. Sphere 0 starts where the original
+// sphere did; the others enter from the left edge, or anywhere on screen
+// when 'scatter' is set.
+void spawnSphere(size_t i, bool scatter) {
+    float left = -2.0f / scaleFactor;
+    float top = 2.0f / scaleFactor;
+    if (i == 0) {
+        spheres.x[0] = left;
+        spheres.y[0] = top;
+        spheres.velocityX[0] = 2.0f * speed;
+        spheres.velocityY[0] = 0.0f;
+    } else {
+        float floor = groundY / scaleFactor + spheres.radius[i] - 1.0f;
+        spheres.x[i] = scatter ? left + 2.0f * top * sphereRandom(i, 1) : left;
+        spheres.y[i] = floor + (top - floor) * sphereRandom(i, 2);
+        spheres.velocityX[i] = speed * (0.5f + 2.5f * sphereRandom(i, 3));
+        spheres.velocityY[i] = scatter ? speed * (sphereRandom(i, 4) - 0.5f) * 4.0f : 0.0f;
+    }
+
+    // Appear in place instead of sliding over from where it left
+    spheres.previousX[i] = spheres.x[i];
+    spheres.previousY[i] = spheres.y[i];
+}
+
+void resetPosition() {
+    fastForwardSeconds = 0.0;  // a fresh start ends any fast-forward
+    for (size_t i = 0; i < spheres.size(); i++) {
+        spawnSphere(i, true);
+    }
+}
+
+void setSphereCount(size_t count) {
+    spheres.x.resize(count);
+    spheres.y.resize(count);
+    spheres.previousX.resize(count);
+    spheres.previousY.resize(count);
+    spheres.velocityX.resize(count);
+    spheres.velocityY.resize(count);
+    spheres.radius.resize(count);
+    spheres.material.resize(count);
+    spheres.layer.resize(count);
+    spheres.lod.resize(count);
+
+    // Radii shrink beyond 1000 spheres so they cover the same area, about
+    // 40% of the screen
+    float radiusScale = std::min(1.0f, sqrtf(1000.0f / count));
+    for (size_t i = 0; i < count; i++) {
+        spheres.radius[i] = i == 0 ? 1.0f : radiusScale * (0.05f + 0.15f * sphereRandom(i, 5));
+        spheres.material[i] = i == 0 ? MaterialPlastic : (unsigned char)(sphereRandom(i, 6) * NumMaterials);
+        spheres.layer[i] = i == 0 ? 0 : (unsigned char)(sphereRandom(i, 7) * NumTextureLayers);
+        spheres.lod[i] = NumLODs / 2;
+    }
+    resetPosition();
+    std::cout << count << (count == 1 ? " sphere" : " spheres") << std::endl;
+}
+
+// Ground contact height of sphere i: a sphere of radius r touches the
+// ground r - 1 higher than sphere 0
+float sphereFloor(size_t i) {
+    return groundY / scaleFactor + spheres.radius[i] - 1.0f;
+}
+
+// Time until a body 'height' above the ground, moving up at 'velocity'
+// under 'acceleration' (< 0), reaches the ground; 0 if it is already
+// below. Each branch avoids subtracting two nearly equal numbers.
+double timeToGround(double height, double velocity, double acceleration) {
+    double root = sqrt(std::max(velocity * velocity - 2.0 * acceleration * height, 0.0));
+    if (velocity <= 0.0) {
+        return root - velocity > 0.0 ? std::max(2.0 * height / (root - velocity), 0.0) : 0.0;
+    }
+    return std::max((velocity + root) / -acceleration, 0.0);
+}
+
+// Bounces slower than this end with the sphere resting on the ground
+const float RestSpeed = 0.2f;
+
+// Advances sphere i by 'time' seconds. Between events a sphere follows its
+// parabola exactly, so instead of integrating in small steps this jumps from
+// one event to the next: the ground impact, where it bounces keeping
+// 'bounceEnergy' of its speed, or leaving the window, where it respawns. A
+// collision can knock a sphere backwards, so it leaves either on the right
+// or, once wholly out of view, on the left. The cost is the number of events,
+// however long 'time' is. Once a bounce is slower than RestSpeed the sphere
+// stays on the ground; otherwise the bounces would get ever shorter without
+// end. Returns the number of events.
+long advanceSphere(size_t i, double time) {
+    double acceleration = gravity * speed;
+    float floor = sphereFloor(i);
+    float rightEdge = 2.0f / scaleFactor;
+    float leftExit = -2.0f / scaleFactor - spheres.radius[i];  // centre once the sphere is out of view
+    long events = 0;
+
+    while (time > 0.0) {
+        double x = spheres.x[i], y = spheres.y[i];
+        double vx = spheres.velocityX[i], vy = spheres.velocityY[i];
+        if (x >= rightEdge || x <= leftExit) {
+            spawnSphere(i, false);
+            events++;
+            continue;
+        }
+
+        // Zooming moves the floor, which can leave a falling sphere below
+        // it: that sphere bounces at once
+        bool resting = y <= floor && fabs(vy) < RestSpeed;
+        bool belowFloor = y <= floor && vy <= 0.0;
+        double toGround = resting ? HUGE_VAL : belowFloor ? 0.0 : timeToGround(y - floor, vy, acceleration);
+        double toEdge = vx > 0.0 ? (rightEdge - x) / vx : vx < 0.0 ? (leftExit - x) / vx : HUGE_VAL;
+        double t = std::min(time, std::min(toGround, toEdge));
+
+        x += vx * t;
+        if (resting) {
+            y = floor;
+            vy = 0.0;
+        } else {
+            y += vy * t + 0.5 * acceleration * t * t;
+            vy += acceleration * t;
+        }
+        time -= t;
+
+        if (t == toGround) {
+            y = floor;
+            vy = -vy * bounceEnergy; // Reverse and reduce velocity
+            if (vy < RestSpeed) {
+                vy = 0.0;
+            }
+            events++;
+        }
+        else if (t == toEdge) {
+            x = vx > 0.0 ? rightEdge : leftExit;  // respawned at the top of the loop
+        }
+        spheres.x[i] = float(x);
+        spheres.y[i] = float(y);
+        spheres.velocityX[i] = float(vx);
+        spheres.velocityY[i] = float(vy);
+    }
+    return events;
+}
+
+// The single-sphere rules applied to every sphere: gravity, a bounce off
+// the ground and a respawn once the sphere leaves the window. Touching
+// spheres bounce off each other with the same energy loss.
+void updateSpheres(float deltaTime) {
+    size_t count = spheres.size();
+    for (size_t i = 0; i < count; i++) {
+        advanceSphere(i, deltaTime);
+    }
+
+    if (sphereCollisions && count > 1) {
+        float* x = spheres.x.data();
+        float* y = spheres.y.data();
+        float* vx = spheres.velocityX.data();
+        float* vy = spheres.velocityY.data();
+        const float* radius = spheres.radius.data();
+        if (count <= BruteForceMaxSpheres) {
+            bruteForcePairs(x, y, radius, count, collidingPairs);
+        } else {
+            broadPhase.findPairs(x, y, radius, count, collidingPairs);
+        }
+        resolveSphereCollisions(collidingPairs, x, y, vx, vy, radius, bounceEnergy);
+
+        // Collisions may push spheres into the ground; they bounce from
+        // there at the start of the next step
+        for (size_t i = 0; i < count; i++) {
+            y[i] = std::max(y[i], sphereFloor(i));
+        }
+    }
+}
+
+// Starts jumping the simulation ahead by 'seconds' event by event; the
+// spheres jump in continueFastForward(). Sphere-sphere collisions are not
+// simulated during the jump.
+void fastForward(double seconds) {
+    if (fastForwardSeconds > 0.0) {
+        return;  // one at a time
+    }
+    fastForwardSeconds = seconds;
+    fastForwardNext = 0;
+    fastForwardEvents = 0;
+    fastForwardWork = 0.0;
+    if (selfRotate) {
+        Theta[Yaxis] = fmod(Theta[Yaxis] + SelfRotationSpeed * seconds, 360.0);
+    }
+}
+
+// Jumps the next spheres of a running fast-forward, for at most
+// FastForwardBudget seconds
+void continueFastForward() {
+    if (fastForwardSeconds <= 0.0) {
+        return;
+    }
+    double start = glfwGetTime();
+    while (fastForwardNext < spheres.size()) {
+        size_t i = fastForwardNext++;
+        fastForwardEvents += advanceSphere(i, fastForwardSeconds);
+        spheres.previousX[i] = spheres.x[i];
+        spheres.previousY[i] = spheres.y[i];
+        if (fastForwardNext % 64 == 0 && glfwGetTime() - start >= FastForwardBudget) {
+            break;
+        }
+    }
+    fastForwardWork += glfwGetTime() - start;
+    if (fastForwardNext >= spheres.size()) {
+        std::cout << "Skipped " << fastForwardSeconds << " s of simulated time: " << fastForwardEvents
+                  << " events in " << 1000.0 * fastForwardWork << " ms" << std::endl;
+        fastForwardSeconds = 0.0;
+    }
+}
+
+// One fixed simulation step
+void stepSimulation() {
+    TRACE_ZONE("stepSimulation");
+    spheres.previousX = spheres.x;
+    spheres.previousY = spheres.y;
+    updateSpheres(PhysicsTimeStep);
+
+    if (selfRotate){
+        Theta[Yaxis] += SelfRotationSpeed * PhysicsTimeStep;
+        if (Theta[Yaxis] > 360.0) {
+            Theta[Yaxis] -= 360.0;
+        }
+    }
+}
+
+// Position of sphere i 'alpha' of the way from its previous to its current state
+vec2 interpolatedPosition(size_t i, float alpha) {
+    return vec2(spheres.previousX[i] + (spheres.x[i] - spheres.previousX[i]) * alpha,
+                spheres.previousY[i] + (spheres.y[i] - spheres.previousY[i]) * alpha);
+}
+
+// Culls the spheres against the view volume of 'modelView', picks each
+// visible sphere's LOD and uploads their instance data sorted by LOD, so
+// each group is contiguous. Impostors have no LODs and form one group.
+void prepareSpheres(float alpha, const mat4& modelView) {
+    if (frustumCulling) {
+        mat4 clip = projection * modelView;
+        cullSpheres(spheres.x.data(), spheres.y.data(), spheres.previousX.data(), spheres.previousY.data(),
+                    spheres.radius.data(), spheres.size(), alpha, frustumFromMatrix(clip), visibleSpheres);
+    } else {
+        visibleSpheres.resize(spheres.size());
+        std::iota(visibleSpheres.begin(), visibleSpheres.end(), 0u);
+    }
+
+    size_t count = visibleSpheres.size();
+    bool impostors = sphereGeometry == GeometryImpostor;
+    // The ortho projection maps 4 units onto the shorter window side
+    float pixelsPerUnit = scaleFactor * std::min(windowWidth, windowHeight) / 4.0f;
+    int* groupSize = sphereGroupSize;
+    std::fill(groupSize, groupSize + NumLODs, 0);
+    if (impostors) {
+        groupSize[0] = int(count);
+    } else {
+        for (uint32_t i : visibleSpheres) {
+            spheres.lod[i] = (unsigned char) selectLOD(spheres.radius[i] * pixelsPerUnit, spheres.lod[i]);
+            groupSize[spheres.lod[i]]++;
+        }
+    }
+
+    int next[NumLODs];
+    for (int level = 0, start = 0; level < NumLODs; level++) {
+        sphereGroupStart[level] = next[level] = start;
+        start += groupSize[level];
+    }
+
+    instanceData.resize(count);
+    for (uint32_t i : visibleSpheres) {
+        SphereInstance& instance = instanceData[next[impostors ? 0 : spheres.lod[i]]++];
+        vec2 position = interpolatedPosition(i, alpha);
+        instance.x = position.x;
+        instance.y = position.y;
+        instance.radius = spheres.radius[i];
+        instance.layer = float((spheres.layer[i] + currentTexture) % NumTextureLayers);
+        instance.material = float((spheres.material[i] + materialIndex) % NumMaterials);
+    }
+
+    // Orphan last frame's storage instead of waiting for the GPU to finish with it
+    glBindBuffer( GL_ARRAY_BUFFER, instanceBuffer );
+    glBufferData( GL_ARRAY_BUFFER, count * sizeof(SphereInstance), NULL, GL_STREAM_DRAW );
+    glBufferSubData( GL_ARRAY_BUFFER, 0, count * sizeof(SphereInstance), instanceData.data() );
+}
+
+// Draws the prepared spheres with program 'u', one instanced draw per LOD
+void drawSpheres(const ProgramUniforms& u) {
+    TRACE_ZONE("drawSpheres");
+    if (sphereGeometry == GeometryMesh) {
+        if (meshVertexArray == 0) {
+            buildSphereMesh();
+        }
+        glBindVertexArray( meshVertexArray );
+    } else {
+        glBindVertexArray( instanceVertexArray );
+    }
+
+    glBindBuffer( GL_ARRAY_BUFFER, instanceBuffer );
+    for (int level = 0; level < NumLODs; level++) {
+        int groupSize = sphereGroupSize[level];
+        if (groupSize == 0) {
+            continue;
+        }
+        size_t offset = sphereGroupStart[level] * sizeof(SphereInstance);
+        glVertexAttribPointer( 3, 3, GL_FLOAT, GL_FALSE, sizeof(SphereInstance), BUFFER_OFFSET(offset) );
+        glVertexAttribPointer( 4, 2, GL_FLOAT, GL_FALSE, sizeof(SphereInstance),
+                               BUFFER_OFFSET(offset + offsetof(SphereInstance, layer)) );
+
+        if (sphereGeometry == GeometryMesh) {
+            const SphereLOD& lod = sphereLODs[level];
+            glDrawElementsInstancedBaseVertex( GL_TRIANGLES, lod.indexCount, GL_UNSIGNED_INT,
+                                               BUFFER_OFFSET(lod.firstIndex * sizeof(GLuint)),
+                                               groupSize, lod.baseVertex );
+        } else if (sphereGeometry == GeometryProcedural) {
+            // Two triangles per quad
+            int stacks = proceduralStacks(level);
+            glUniform1i( u.stacks, stacks );
+            glDrawArraysInstanced( GL_TRIANGLES, 0, 6 * stacks * 2 * stacks, groupSize );
+        } else {
+            glDrawArraysInstanced( GL_TRIANGLE_STRIP, 0, 4, groupSize );
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// Virtual texturing
+//
+// The source is cut once into a pyramid of tiles on disk (VirtualTexture.h);
+// only the tiles the spheres show are kept, in an atlas texture of
+// VirtualAtlasSlots x VirtualAtlasSlots tiles whatever the source's size.
+// A feedback pass draws the spheres again at 1/VirtualFeedbackDivisor of the
+// window size, writing the page each pixel would read. It is read back
+// through a pixel buffer one frame later, so it never stalls, and becomes
+// the tile requests. The page table texture maps every page to the closest
+// resident tile, so missing tiles show a coarser level until they arrive.
+
+GLuint feedbackFramebuffer = 0, feedbackColor, feedbackDepth;
+GLuint feedbackBuffers[2];  // read back alternately
+bool feedbackPending[2] = { false, false };
+int feedbackWidth = 0, feedbackHeight = 0, feedbackFrame = 0;
+std::vector<VirtualTexture::Tile> loadedTiles;
+std::vector<uint32_t> visiblePages;
+
+// First use of V: the atlas starts grey, like the texture array, while the
+// loader opens the tiles (cutting them first if needed)
+void startVirtualTexturing() {
+    if (tileAtlasTexture != 0) {
+        return;
+    }
+    int atlasSize = VirtualAtlasSlots * VirtualTileStride;
+    std::vector<unsigned char> placeholder(size_t(atlasSize) * atlasSize * 3, 128);
+    glGenTextures(1, &tileAtlasTexture);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, tileAtlasTexture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, atlasSize, atlasSize, 0, GL_RGB, GL_UNSIGNED_BYTE, placeholder.data());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glActiveTexture(GL_TEXTURE0);
+
+    virtualTexture.start(VirtualTextureFile, VirtualAtlasSlots, TextureMipFilter);
+}
+
+// Turns a finished feedback read back into page requests
+void readVirtualFeedback(int index) {
+    if (!feedbackPending[index]) {
+        return;
+    }
+    feedbackPending[index] = false;
+    size_t size = size_t(feedbackWidth) * feedbackHeight * 4;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, feedbackBuffers[index]);
+    const unsigned char* pixels = static_cast<const unsigned char*>(
+        glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT));
+    if (pixels != NULL) {
+        // Pixels hold (page x, page y, level, 255), or 0 where nothing needs the virtual texture
+        visiblePages.clear();
+        for (size_t i = 0; i < size; i += 4) {
+            if (pixels[i + 3] != 0) {
+                visiblePages.push_back(VirtualTexture::pageKey(pixels[i + 2], pixels[i], pixels[i + 1]));
+            }
+        }
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        std::sort(visiblePages.begin(), visiblePages.end());
+        visiblePages.erase(std::unique(visiblePages.begin(), visiblePages.end()), visiblePages.end());
+        virtualTexture.usePages(visiblePages);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+// Called once per frame with V on: requests the pages last frame's feedback
+// found, copies loaded tiles into their atlas slots and refreshes the page
+// table
+void updateVirtualTexture() {
+    if (!virtualTexture.ready()) {
+        return;
+    }
+    if (pageTableTexture == 0) {
+        glGenTextures(1, &pageTableTexture);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, pageTableTexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, virtualTexture.pageTableWidth(), virtualTexture.pageTableHeight(),
+                     0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glActiveTexture(GL_TEXTURE0);
+    }
+    readVirtualFeedback((feedbackFrame + 1) % 2);
+
+    virtualTexture.takeTiles(VirtualTilesPerFrame, loadedTiles);
+    glActiveTexture(GL_TEXTURE2);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);  // tile rows are tightly packed RGB
+    for (const VirtualTexture::Tile& tile : loadedTiles) {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, (tile.slot % VirtualAtlasSlots) * VirtualTileStride,
+                        (tile.slot / VirtualAtlasSlots) * VirtualTileStride, VirtualTileStride, VirtualTileStride,
+                        GL_RGB, GL_UNSIGNED_BYTE, tile.texels.data());
+    }
+    const unsigned char* pageTable = virtualTexture.updatedPageTable();
+    if (pageTable != NULL) {
+        glActiveTexture(GL_TEXTURE1);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, virtualTexture.pageTableWidth(), virtualTexture.pageTableHeight(),
+                        GL_RGBA, GL_UNSIGNED_BYTE, pageTable);
+    }
+    glActiveTexture(GL_TEXTURE0);
+}
+
+// 'lodBias' is added to the mip level the shader derives from its texture
+// coordinate derivatives
+void setVirtualTextureUniforms(const ProgramUniforms& u, float lodBias) {
+    glUniform2i(u.virtualSize, virtualTexture.width(), virtualTexture.height());
+    glUniform1i(u.virtualLevels, virtualTexture.levelCount());
+    glUniform1iv(u.pageTableRows, virtualTexture.levelCount(), virtualTexture.pageTableRows());
+    glUniform1f(u.virtualLodBias, lodBias);
+}
+
+// (Re)allocates the feedback target and its read back buffers
+void resizeFeedback(int width, int height) {
+    if (feedbackFramebuffer == 0) {
+        glGenFramebuffers(1, &feedbackFramebuffer);
+        glGenRenderbuffers(1, &feedbackColor);
+        glGenRenderbuffers(1, &feedbackDepth);
+        glGenBuffers(2, feedbackBuffers);
+    }
+    feedbackWidth = width;
+    feedbackHeight = height;
+    glBindRenderbuffer(GL_RENDERBUFFER, feedbackColor);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, feedbackDepth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glBindFramebuffer(GL_FRAMEBUFFER, feedbackFramebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, feedbackColor);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, feedbackDepth);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    for (int i = 0; i < 2; i++) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, feedbackBuffers[i]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, size_t(width) * height * 4, NULL, GL_STREAM_READ);
+        feedbackPending[i] = false;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+// Draws the prepared spheres into the feedback target and starts reading it
+// back. Skipped while the feedback program is still compiling.
+void drawVirtualFeedback(const mat4& modelView, const mat4& rotation) {
+    unsigned variant = (currentVariant() & VariantGeometryMask) | VariantVirtual | VariantFeedback;
+    auto it = shaderVariants.find(variant);
+    if (it == shaderVariants.end()) {
+        submitShaderVariant(variant);
+        if (!ShaderReady(pendingVariants[variant])) {
+            return;
+        }
+        finishShaderVariant(variant);
+        it = shaderVariants.find(variant);
+    }
+    const ProgramUniforms& u = it->second;
+
+    int width = std::max(windowWidth / VirtualFeedbackDivisor, 1);
+    int height = std::max(windowHeight / VirtualFeedbackDivisor, 1);
+    if (width != feedbackWidth || height != feedbackHeight) {
+        resizeFeedback(width, height);
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, feedbackFramebuffer);
+    glViewport(0, 0, width, height);
+    const GLfloat noPage[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    glClearBufferfv(GL_COLOR, 0, noPage);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+
+    // Derivatives are VirtualFeedbackDivisor times larger at this size
+    glUseProgram(u.program);
+    glUniformMatrix4fv(u.modelView, 1, GL_TRUE, modelView);
+    glUniformMatrix4fv(u.rotation, 1, GL_TRUE, rotation);
+    setVirtualTextureUniforms(u, -log2f(float(VirtualFeedbackDivisor)));
+    drawSpheres(u);
+
+    int index = feedbackFrame % 2;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, feedbackBuffers[index]);
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, BUFFER_OFFSET(0));
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    feedbackPending[index] = true;
+    feedbackFrame++;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, windowWidth, windowHeight);
+}
+
+//----------------------------------------------------------------------------
+// Clustered lighting
+//
+// Point lights drift over the window just in front of the spheres. Every
+// frame they are binned (ClusteredLights.h, on every core) into clusters of
+// ClusterTilePixels square screen tiles by ClusterSlices slices of the
+// spheres' depth, and the lists reach the shader through three texture
+// buffers: each cluster's (offset, count) on unit 3, the light indices on
+// unit 4 and the lights themselves on unit 5. A fragment then shades only
+// the lights of its cluster.
+
+const int ClusterTilePixels = 64;
+const int ClusterSlices = 16;
+const float PointLightRange = 0.35f;  // eye coordinates; the window is at least 4 across
+
+enum { ClusterRangeBuffer = 0, LightIndexBuffer = 1, PointLightBuffer = 2, NumClusterBuffers = 3 };
+GLuint clusterBuffers[NumClusterBuffers], clusterTextures[NumClusterBuffers];
+std::unique_ptr<LightClusters> lightClusters;  // started on first use, with its threads
+std::vector<PointLight> pointLights;
+ClusterGrid clusterGrid;
+double pointLightTime = 0.0;
+double lightBinningTimeSum = 0.0;
+
+// First use of the point lights: the binning threads and the texture buffers
+void startClusteredLighting() {
+    lightClusters.reset(new LightClusters());
+    const GLenum formats[NumClusterBuffers] = { GL_RG32UI, GL_R16UI, GL_RGBA32F };
+    glGenBuffers(NumClusterBuffers, clusterBuffers);
+    glGenTextures(NumClusterBuffers, clusterTextures);
+    for (int i = 0; i < NumClusterBuffers; i++) {
+        glBindBuffer(GL_TEXTURE_BUFFER, clusterBuffers[i]);
+        glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+        glActiveTexture(GL_TEXTURE3 + i);
+        glBindTexture(GL_TEXTURE_BUFFER, clusterTextures[i]);
+        glTexBuffer(GL_TEXTURE_BUFFER, formats[i], clusterBuffers[i]);
+    }
+    glActiveTexture(GL_TEXTURE0);
+}
+
+// Replaces the contents of a texture buffer, orphaning last frame's storage
+void streamTextureBuffer(GLuint buffer, const void* data, size_t size) {
+    glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+    glBufferData(GL_TEXTURE_BUFFER, std::max(size, size_t(16)), NULL, GL_STREAM_DRAW);
+    if (size > 0) {
+        glBufferSubData(GL_TEXTURE_BUFFER, 0, size, data);
+    }
+}
+
+// Moves the point lights on by 'deltaTime' (unless paused), bins them for
+// the current window and uploads the lists
+void updateClusteredLights(double deltaTime) {
+    if (!lightClusters) {
+        startClusteredLighting();
+    }
+    if (!paused) {
+        pointLightTime += std::min(deltaTime, MaxFrameTime);
+    }
+
+    // Each light follows its own Lissajous path over the whole window
+    int count = PointLightCounts[pointLightCountIndex];
+    float t = float(pointLightTime);
+    pointLights.resize(count);
+    for (int i = 0; i < count; i++) {
+        PointLight& light = pointLights[i];
+        float u = 0.5f + 0.5f * sinf((0.1f + 0.3f * sphereRandom(i, 20)) * t + 6.2832f * sphereRandom(i, 21));
+        float v = 0.5f + 0.5f * sinf((0.1f + 0.3f * sphereRandom(i, 22)) * t + 6.2832f * sphereRandom(i, 23));
+        light.x = viewLeft + (viewRight - viewLeft) * u;
+        light.y = viewBottom + (viewTop - viewBottom) * v;
+        light.z = 0.05f + 0.2f * sphereRandom(i, 24);
+        light.range = PointLightRange;
+        light.red = 0.2f + 0.8f * sphereRandom(i, 25);
+        light.green = 0.2f + 0.8f * sphereRandom(i, 26);
+        light.blue = 0.2f + 0.8f * sphereRandom(i, 27);
+        light.padding = 0.0f;
+    }
+
+    // Every centre is at z = 0 and sphere 0 is the largest, so the slices
+    // only need to span its depth
+    float depth = spheres.radius[0] * scaleFactor;
+    clusterGrid.tilesX = (windowWidth + ClusterTilePixels - 1) / ClusterTilePixels;
+    clusterGrid.tilesY = (windowHeight + ClusterTilePixels - 1) / ClusterTilePixels;
+    clusterGrid.slices = ClusterSlices;
+    clusterGrid.left = viewLeft;
+    clusterGrid.bottom = viewBottom;
+    clusterGrid.tileWidth = (viewRight - viewLeft) * ClusterTilePixels / windowWidth;
+    clusterGrid.tileHeight = (viewTop - viewBottom) * ClusterTilePixels / windowHeight;
+    clusterGrid.zMin = -depth;
+    clusterGrid.sliceDepth = 2.0f * depth / ClusterSlices;
+
+    double start = glfwGetTime();
+    lightClusters->assign(clusterGrid, pointLights);
+    lightBinningTimeSum += glfwGetTime() - start;
+
+    const std::vector<uint32_t>& ranges = lightClusters->ranges();
+    const std::vector<uint16_t>& indices = lightClusters->lightIndices();
+    streamTextureBuffer(clusterBuffers[ClusterRangeBuffer], ranges.data(), ranges.size() * sizeof(uint32_t));
+    streamTextureBuffer(clusterBuffers[LightIndexBuffer], indices.data(), indices.size() * sizeof(uint16_t));
+    streamTextureBuffer(clusterBuffers[PointLightBuffer], pointLights.data(), pointLights.size() * sizeof(PointLight));
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+void setClusterUniforms(const ProgramUniforms& u) {
+    glUniform3i(u.clusterGrid, clusterGrid.tilesX, clusterGrid.tilesY, clusterGrid.slices);
+    glUniform1f(u.clusterTileScale, 1.0f / ClusterTilePixels);
+    glUniform2f(u.clusterDepth, clusterGrid.zMin, 1.0f / clusterGrid.sliceDepth);
+}
+
+//----------------------------------------------------------------------------
+// Deferred shading, toggled with D
+//
+// The spheres are drawn once into a G-buffer with no lighting at all: RGBA8
+// albedo with the material index in alpha, the eye normal octahedrally
+// packed into RG16F, and depth. A full-screen pass then lights each covered
+// pixel once with the Phong model (and the clustered point lights), taking
+// the eye position from the depth. Pixels drawn over by a nearer sphere
+// cost only the G-buffer writes, where forward Phong lit every one of them.
+// The G-buffer is on texture units 6 to 8 for the lighting pass.
+
+enum { GBufferAlbedo = 0, GBufferNormal = 1, GBufferDepth = 2, NumGBufferTextures = 3 };
+GLuint gBufferFramebuffer = 0, gBufferTextures[NumGBufferTextures];
+int gBufferWidth = 0, gBufferHeight = 0;
+GLuint fullScreenVertexArray;  // no attributes: the lighting pass uses gl_VertexID
+
+// (Re)allocates the G-buffer at the window size
+void resizeGBuffer(int width, int height) {
+    if (gBufferFramebuffer == 0) {
+        glGenFramebuffers(1, &gBufferFramebuffer);
+        glGenTextures(NumGBufferTextures, gBufferTextures);
+        glGenVertexArrays(1, &fullScreenVertexArray);
+    }
+    gBufferWidth = width;
+    gBufferHeight = height;
+
+    const GLenum internalFormats[NumGBufferTextures] = { GL_RGBA8, GL_RG16F, GL_DEPTH_COMPONENT24 };
+    const GLenum formats[NumGBufferTextures] = { GL_RGBA, GL_RG, GL_DEPTH_COMPONENT };
+    const GLenum types[NumGBufferTextures] = { GL_UNSIGNED_BYTE, GL_HALF_FLOAT, GL_UNSIGNED_INT };
+    for (int i = 0; i < NumGBufferTextures; i++) {
+        glActiveTexture(GL_TEXTURE6 + i);
+        glBindTexture(GL_TEXTURE_2D, gBufferTextures[i]);
+        glTexImage2D(GL_TEXTURE_2D, 0, internalFormats[i], width, height, 0, formats[i], types[i], NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    }
+    glActiveTexture(GL_TEXTURE0);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, gBufferFramebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, gBufferTextures[GBufferAlbedo], 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, gBufferTextures[GBufferNormal], 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, gBufferTextures[GBufferDepth], 0);
+    const GLenum drawBuffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    glDrawBuffers(2, drawBuffers);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        std::cout << "G-buffer framebuffer is incomplete" << std::endl;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// Draws the prepared spheres into the G-buffer with the G-buffer program
+// 'u', then lights the window from it. The lighting pass program is waited
+// for: there is nothing to show without it.
+void drawDeferred(const ProgramUniforms& u) {
+    if (windowWidth != gBufferWidth || windowHeight != gBufferHeight) {
+        resizeGBuffer(windowWidth, windowHeight);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, gBufferFramebuffer);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    drawSpheres(u);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    unsigned variant = lightingPassVariant();
+    auto it = shaderVariants.find(variant);
+    if (it == shaderVariants.end()) {
+        submitShaderVariant(variant);
+        finishShaderVariant(variant);
+        it = shaderVariants.find(variant);
+    }
+    const ProgramUniforms& lighting = it->second;
+    glUseProgram(lighting.program);
+    if (variant & VariantClustered) {
+        setClusterUniforms(lighting);
+    }
+    glDisable(GL_DEPTH_TEST);
+    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+    glBindVertexArray(fullScreenVertexArray);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glEnable(GL_DEPTH_TEST);
+}
+
+// Depth pre-pass, toggled with E: the prepared spheres are drawn first with
+// the cheapest variant (Gouraud, no texture, no lighting terms) and colour
+// writes off, then the shading pass tests GL_LEQUAL without writing depth,
+// so early depth testing rejects every fragment but the visible one before
+// its shader runs. gl_Position is invariant in the vertex shader, so both
+// passes produce the same depth. Impostors write their depth from the
+// fragment shader, which turns early depth testing off, so they skip it.
+// Returns false, leaving the depth state alone, while the depth-only
+// program is still compiling.
+bool drawDepthPrepass(const mat4& modelView, const mat4& rotation) {
+    unsigned variant = currentVariant() & VariantGeometryMask;
+    auto it = shaderVariants.find(variant);
+    if (it == shaderVariants.end()) {
+        submitShaderVariant(variant);
+        if (!ShaderReady(pendingVariants[variant])) {
+            return false;
+        }
+        finishShaderVariant(variant);
+        it = shaderVariants.find(variant);
+    }
+    const ProgramUniforms& u = it->second;
+
+    glUseProgram(u.program);
+    glUniformMatrix4fv(u.modelView, 1, GL_TRUE, modelView);
+    glUniformMatrix4fv(u.rotation, 1, GL_TRUE, rotation);
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    drawSpheres(u);
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glDepthFunc(GL_LEQUAL);
+    glDepthMask(GL_FALSE);
+    return true;
+}
+
+// Prints the average frame time and the share spent simulating and
+// building instance data (CPU side, before the driver sees the draws)
+void reportFrameTime(double currentTime, double deltaTime, double simulationTime) {
+    if (spheres.size() <= 1) {
+        return;
+    }
+    framesSinceReport++;
+    frameTimeSum += deltaTime;
+    simulationTimeSum += simulationTime;
+    if (currentTime - lastReportTime < FrameReportInterval) {
+        return;
+    }
+    std::cout << spheres.size() << " spheres (" << visibleSpheres.size() << " in view): "
+              << 1000.0 * frameTimeSum / framesSinceReport << " ms/frame, "
+              << 1000.0 * simulationTimeSum / framesSinceReport << " ms simulation + instancing";
+    if (lightBinningTimeSum > 0.0) {
+        std::cout << " (" << 1000.0 * lightBinningTimeSum / framesSinceReport << " ms binning "
+                  << pointLights.size() << " point lights)";
+    }
+    std::cout << std::endl;
+    framesSinceReport = 0;
+    frameTimeSum = simulationTimeSum = lightBinningTimeSum = 0.0;
+    lastReportTime = currentTime;
+}
+
+//----------------------------------------------------------------------------
+
+// Per-instance attributes of the bound vertex array, streamed every frame;
+// drawSpheres() points them at each LOD group in turn
 void
-init()
+enableInstanceAttributes()
+{
+    glEnableVertexAttribArray( 3 );  // vInstance
+    glVertexAttribDivisor( 3, 1 );
+    glEnableVertexAttribArray( 4 );  // vStyle
+    glVertexAttribDivisor( 4, 1 );
+}
+
+// Generates every LOD of the sphere mesh and its vertex array
+void
+buildSphereMesh()
 {
     // Subdivide a tetrahedron into a sphere
-    tetrahedron( NumTimesToSubdivide );
+    for ( int level = 0; level < NumLODs; level++ ) {
+        tetrahedron( level );
+    }
     
     // Create a vertex array object
-    GLuint vao;
-    glGenVertexArrays( 1, &vao );
-    glBindVertexArray( vao );
+    glGenVertexArrays( 1, &meshVertexArray );
+    glBindVertexArray( meshVertexArray );
     
     // Create and initialize a buffer object
+    std::vector<SphereVertex> vertices = packVertices();
     GLuint buffer;
     glGenBuffers( 1, &buffer );
     glBindBuffer( GL_ARRAY_BUFFER, buffer );
-    glBufferData( GL_ARRAY_BUFFER, sizeof(points) + sizeof(normals) + sizeof(texCoords), NULL, GL_STATIC_DRAW );
-    glBufferSubData( GL_ARRAY_BUFFER, 0, sizeof(points), points );
-    glBufferSubData( GL_ARRAY_BUFFER, sizeof(points), sizeof(normals), normals );
-    glBufferSubData( GL_ARRAY_BUFFER, sizeof(points) + sizeof(normals), sizeof(texCoords), texCoords );
-    
-    // Load both shader programs
-    gouraudProgram = InitShader( "vshader.glsl", "fshader.glsl" );
-    phongProgram = InitShader( "vshader_phong.glsl", "fshader_phong.glsl" );
-    
-    // Initially use Gouraud shader
-    glUseProgram(gouraudProgram);
-    
-    // set up vertex arrays for both programs
-    GLuint vPosition = glGetAttribLocation( gouraudProgram, "vPosition" );
-    glEnableVertexAttribArray( vPosition );
-    glVertexAttribPointer( vPosition, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0) );
-    
-    GLuint vNormal = glGetAttribLocation( gouraudProgram, "vNormal" ); 
-    glEnableVertexAttribArray( vNormal );
-    glVertexAttribPointer( vNormal, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(sizeof(points)) );
-    
-    GLuint vTexCoord = glGetAttribLocation( gouraudProgram, "vTexCoord" ); 
-    glEnableVertexAttribArray( vTexCoord );
-    glVertexAttribPointer( vTexCoord, 2, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(sizeof(points) + sizeof(normals)) );
-
-    // Set up vertex arrays for phongProgram
-    glUseProgram(phongProgram);
-    GLuint vPosition_phong = glGetAttribLocation( phongProgram, "vPosition" );
-    glEnableVertexAttribArray( vPosition_phong );
-    glVertexAttribPointer( vPosition_phong, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0) );
-
-    GLuint vNormal_phong = glGetAttribLocation( phongProgram, "vNormal" );
-    glEnableVertexAttribArray( vNormal_phong );
-    glVertexAttribPointer( vNormal_phong, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(sizeof(points)) );
-
-    GLuint vTexCoord_phong = glGetAttribLocation( phongProgram, "vTexCoord" );
-    glEnableVertexAttribArray( vTexCoord_phong );
-    glVertexAttribPointer( vTexCoord_phong, 2, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(sizeof(points) + sizeof(normals)) );
-
-    // Switch back to Gouraud shader
-    glUseProgram(gouraudProgram);
-    
-    
-    plasticMaterial();
+    glBufferData( GL_ARRAY_BUFFER, vertices.size() * sizeof(SphereVertex), vertices.data(), GL_STATIC_DRAW );
+
+    // Index buffer for the welded vertices (bound to the VAO)
+    GLuint indexBuffer;
+    glGenBuffers( 1, &indexBuffer );
+    glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, indexBuffer );
+    glBufferData( GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW );
     
+    // Vertex attribute locations are fixed in the shader source, so this one
+    // VAO serves every shader permutation
+    glEnableVertexAttribArray( 0 );  // vPosition
+    glVertexAttribPointer( 0, 4, GL_SHORT, GL_TRUE, sizeof(SphereVertex),
+                           BUFFER_OFFSET(offsetof(SphereVertex, position)) );
+
+    glEnableVertexAttribArray( 2 );  // vTexCoord
+    glVertexAttribPointer( 2, 2, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(SphereVertex),
+                           BUFFER_OFFSET(offsetof(SphereVertex, texCoord)) );
+
+    enableInstanceAttributes();
+}
+
+//----------------------------------------------------------------------------
+
+// OpenGL initialization
+void
+init()
+{
+    glGenBuffers( 1, &instanceBuffer );
+
+    // Procedural spheres and impostors need only the instance attributes
+    glGenVertexArrays( 1, &instanceVertexArray );
+    glBindVertexArray( instanceVertexArray );
+    enableInstanceAttributes();
+
+    if (sphereGeometry == GeometryMesh) {
+        buildSphereMesh();
+    }
+
+    setSphereCount( SphereCounts[sphereCountIndex] );
+
+    setupUniforms();
+
     setupMaterial();
     
     glEnable( GL_DEPTH_TEST );
@@ -374,97 +1794,82 @@ init()
     
     glClearColor( 1.0, 1.0, 1.0, 1.0 ); /* white background */
     
-    // Read and setup first texture
-    if (readPPMImage("basketball.ppm")) {
-        setupTexture();
-    }
+    // Textures stream in from a loader thread; a placeholder is shown meanwhile
+    setupTextures();
     
-    // Read and setup second texture
-    if (readPPMImage("earth.ppm")) {  // You'll need to provide a second PPM file
-        glBindTexture(GL_TEXTURE_2D, textures[1]);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, imageWidth, imageHeight, 0, 
-                     GL_RGB, GL_UNSIGNED_BYTE, imageData);
-        delete[] imageData;
-    }
-    
-    glBindTexture(GL_TEXTURE_2D, textures[0]);
 }
 
 //----------------------------------------------------------------------------
 
-void resetPosition() {
-    sphereY = 2.0f / scaleFactor;
-    sphereX = -2.0f / scaleFactor;
-    velocityY = 0.0f;
-    velocityX = 2.0f * speed;
-}
-
 void
 display( void )
 {
+    TRACE_ZONE("display");
     // Calculate delta time
-    float currentTime = glfwGetTime();
-    float deltaTime = currentTime - lastTime;
+    double currentTime = glfwGetTime();
+    double deltaTime = currentTime - lastTime;
     lastTime = currentTime;
 
-    // Update bouncing physics
-    velocityY += gravity * deltaTime * speed;
-    sphereY += velocityY * deltaTime;
-    sphereX += velocityX * deltaTime;
-    
-    // Get scaled boundaries
-    float scaledGroundY = groundY / scaleFactor;
-    float scaledRightEdge = 2.0f / scaleFactor;
-    
-    // Check for ground collision and bounce
-    if (sphereY <= scaledGroundY) {
-        sphereY = scaledGroundY;
-        velocityY = -velocityY * bounceEnergy; // Reverse and reduce velocity
-    }
-
-    // Check for horizontal boundaries
-    if (sphereX >= scaledRightEdge) {
-        resetPosition();
+    frameTimers.beginPhase(PhaseUploads);
+    pollTextureUploads();
+    if (virtualTexturing) {
+        updateVirtualTexture();
     }
-
-    if (selfRotate){
-        Theta[Yaxis] += 1.0;
-        if (Theta[Yaxis] > 360.0) {
-            Theta[Yaxis] -= 360.0;
+    pollShaderVariants();
+    ReloadShaders(shaderReloaded);
+    frameTimers.endPhase(PhaseUploads);
+
+    // Pausing stops the clock; the scene keeps drawing where it stopped
+    double simulationStart = glfwGetTime();
+    frameTimers.beginPhase(PhaseSimulation, false);
+    if (!paused) {
+        physicsAccumulator += std::min(deltaTime, MaxFrameTime);
+        for (int step = 0; physicsAccumulator >= PhysicsTimeStep; step++) {
+            if (step == MaxStepsPerFrame) {
+                physicsAccumulator = fmod(physicsAccumulator, PhysicsTimeStep);
+                break;
+            }
+            stepSimulation();
+            physicsAccumulator -= PhysicsTimeStep;
         }
     }
+    continueFastForward();
+    float alpha = float(physicsAccumulator / PhysicsTimeStep);
+    frameTimers.endPhase(PhaseSimulation);
 
     glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
     
-    mat4 model_view = Scale(scaleFactor, scaleFactor, scaleFactor) * 
-                     Translate(sphereX, sphereY, 0.0) *
-                     (RotateX( Theta[Xaxis] ) *
-                      RotateY( Theta[Yaxis] ) *
-                      RotateZ( Theta[Zaxis] ) );
+    // Every sphere spins the same way; each instance adds its own radius
+    // and position in the vertex shader
+    mat4 model_view = Scale(scaleFactor, scaleFactor, scaleFactor);
+    mat4 rotation = RotateX( Theta[Xaxis] ) *
+                    RotateY( Theta[Yaxis] ) *
+                    RotateZ( Theta[Zaxis] );
     
-    glUniformMatrix4fv( ModelView, 1, GL_TRUE, model_view );
-
-    // Update light position based on mode
-    point4 light_position;
+    // Update light position based on mode (shared by every program)
     if (fixedLight) {
-        light_position = point4(0.0, 0.0, 2.0, 1.0); // Fixed position
+        setLightPosition(point4(0.0, 0.0, 2.0, 1.0)); // Fixed position
     } else {
-        light_position = point4(sphereX * scaleFactor, sphereY * scaleFactor, 2.0, 1.0); // Moves with sphere
+        vec2 position = interpolatedPosition(0, alpha);
+        setLightPosition(point4(position.x * scaleFactor, position.y * scaleFactor, 2.0, 1.0)); // Moves with sphere 0
     }
     
-    // Update light position for both shader programs
-    for (GLuint program : {gouraudProgram, phongProgram}) {
-        glUseProgram(program);
-        glUniform4fv(glGetUniformLocation(program, "LightPosition"), 1, light_position);
+    // --- Specialized program for this configuration ---
+    unsigned variant = currentVariant();
+    const ProgramUniforms& u = getShaderVariant(variant);
+    glUseProgram(u.program);
+    glUniformMatrix4fv(u.modelView, 1, GL_TRUE, model_view);
+    glUniformMatrix4fv(u.rotation, 1, GL_TRUE, rotation);
+    if (variant & VariantVirtual) {
+        setVirtualTextureUniforms(u, 0.0f);
+    }
+    if ((variant | (useDeferredShading ? lightingPassVariant() : 0)) & VariantClustered) {
+        TimedPhase timed(frameTimers, PhaseLights);
+        updateClusteredLights(deltaTime);
+    }
+    if (variant & VariantClustered) {
+        setClusterUniforms(u);
     }
-    
-    // --- Bind Current Texture ---
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, textures[currentTexture]);
-    GLuint prog = usePhongShader ? phongProgram : gouraudProgram;
-    glUseProgram(prog);
-    glUniform1i(glGetUniformLocation(prog, "tex"), textureIndex);
-    glUniform1i(glGetUniformLocation(prog, "TextureFlag"), textureFlag);
     
     if (textureFlag == 2) {
         // Wireframe mode
@@ -474,8 +1879,29 @@ display( void )
         glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
     }
     
-    glDrawArrays( GL_TRIANGLES, 0, NumVertices );
+    frameTimers.beginPhase(PhaseInstances);
+    prepareSpheres(alpha, model_view);
+    frameTimers.endPhase(PhaseInstances);
+    frameTimers.beginPhase(PhaseSpheres);
+    if (variant & VariantDeferred) {
+        drawDeferred(u);
+    } else if (depthPrepass && sphereGeometry != GeometryImpostor && drawDepthPrepass(model_view, rotation)) {
+        glUseProgram(u.program);
+        drawSpheres(u);
+        glDepthFunc(GL_LESS);
+        glDepthMask(GL_TRUE);
+    } else {
+        drawSpheres(u);
+    }
+    frameTimers.endPhase(PhaseSpheres);
+    if ((variant & VariantVirtual) && textureFlag == 1) {
+        TimedPhase timed(frameTimers, PhaseFeedback);
+        drawVirtualFeedback(model_view, rotation);
+    }
+    frameTimers.drawOverlay();
     glFlush();
+
+    reportFrameTime(currentTime, deltaTime, glfwGetTime() - simulationStart);
 }
 
 //----------------------------------------------------------------------------
@@ -483,10 +1909,13 @@ display( void )
 void printHelp() {
     std::cout << "\n=== Input Controls ===\n"
               << "ESC/Q: Exit program\n"
-              << "R: Reset sphere position\n"
+              << "R: Reset sphere positions\n"
               << "S: Toggle between Gouraud and Phong shading\n"
+              << "D: Toggle deferred shading (G-buffer, then one Phong lighting pass)\n"
+              << "E: Toggle the depth pre-pass (forward shading, mesh and procedural spheres)\n"
+              << "X: Toggle frustum culling\n"
               << "O: Change shading mode\n"
-              << "M: Toggle between plastic and metallic materials\n"
+              << "M: Swap the plastic and metallic materials\n"
               << "Z: Zoom in\n"
               << "W: Zoom out\n"
               << "L: Toggle between fixed and moving light\n"
@@ -495,6 +1924,15 @@ void printHelp() {
               << "T: Toggle texture display mode (no texture/texture/wireframe)\n"
               << "SPACE: Pause/resume animation\n"
               << "K: Toggle self-rotation\n"
+              << "N: Cycle the number of spheres (1/1000/10000/100000)\n"
+              << "C: Toggle sphere-sphere collisions\n"
+              << "F: Fast-forward the simulation by one hour\n"
+              << "P: Cycle the sphere geometry (mesh/procedural/impostor)\n"
+              << "V: Toggle virtual texturing of the earth texture\n"
+              << "G: Cycle the number of point lights (0/64/256/1024, Phong shading only)\n"
+              << "F1: Show/hide frame timings (p50/p95/p99 frame, CPU and GPU times)\n"
+              << "F2: Save frame timings to " << frameTimesFile << "\n"
+              << "F3: Start/stop a Chrome trace of the frame phases (written to " << traceFile << ")\n"
               << "H: Show this help message\n"
               << "===================\n" << std::endl;
 }
@@ -518,26 +1956,35 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
         case GLFW_KEY_S:
             if (action == GLFW_PRESS) {
                 usePhongShader = !usePhongShader;
-                glUseProgram(usePhongShader ? phongProgram : gouraudProgram);
+            }
+            break;
+        case GLFW_KEY_D:
+            if (action == GLFW_PRESS) {
+                useDeferredShading = !useDeferredShading;
+                std::cout << "Deferred shading " << (useDeferredShading ? "on" : "off") << std::endl;
+            }
+            break;
+        case GLFW_KEY_E:
+            if (action == GLFW_PRESS) {
+                depthPrepass = !depthPrepass;
+                std::cout << "Depth pre-pass " << (depthPrepass ? "on" : "off") << std::endl;
+            }
+            break;
+        case GLFW_KEY_X:
+            if (action == GLFW_PRESS) {
+                frustumCulling = !frustumCulling;
+                std::cout << "Frustum culling " << (frustumCulling ? "on" : "off") << std::endl;
             }
             break;
         case GLFW_KEY_O:
             if (action == GLFW_PRESS) {
-                mode = (mode + 1) % 3;
-                glUniform1i(glGetUniformLocation(gouraudProgram, "mode"), mode);
+                mode = (mode + 1) % 4;
             }
             break;
 
         case GLFW_KEY_M:
             if (action == GLFW_PRESS) {
-                materialIndex = (materialIndex + 1) % 2;
-                if (materialIndex == 0){
-                    plasticMaterial();
-                }
-                else{
-                    metallicMaterial();
-                }
-                setupMaterial();
+                materialIndex = (materialIndex + 1) % NumMaterials;
             }
             break;
         // "Zoom-in" to the object
@@ -588,7 +2035,7 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
             
         case GLFW_KEY_I:
             if (action == GLFW_PRESS) {
-                currentTexture = (currentTexture + 1) % 2;
+                currentTexture = (currentTexture + 1) % NumTextureLayers;
             }
             break;
         case GLFW_KEY_T:
@@ -600,17 +2047,6 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
         case GLFW_KEY_SPACE:
             if (action == GLFW_PRESS) {
                 paused = !paused;
-                if (paused) {
-                    tempVelocityX = velocityX;
-                    tempVelocityY = velocityY;
-                    gravity = 0.0f;
-                    velocityX = 0.0f;
-                    velocityY = 0.0f;
-                } else {
-                    velocityX = tempVelocityX;
-                    velocityY = tempVelocityY;
-                    gravity = -9.81f * speed;
-                }
             }
             break;
         
@@ -619,6 +2055,66 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
                 selfRotate = !selfRotate;
             }
             break;
+
+        case GLFW_KEY_C:
+            if (action == GLFW_PRESS) {
+                sphereCollisions = !sphereCollisions;
+            }
+            break;
+
+        case GLFW_KEY_F:
+            if (action == GLFW_PRESS) {
+                fastForward(FastForwardSeconds);
+            }
+            break;
+
+        case GLFW_KEY_P:
+            if (action == GLFW_PRESS) {
+                sphereGeometry = (sphereGeometry + 1) % NumGeometries;
+                std::cout << "Sphere geometry: " << geometryNames[sphereGeometry] << std::endl;
+            }
+            break;
+
+        case GLFW_KEY_V:
+            if (action == GLFW_PRESS) {
+                virtualTexturing = !virtualTexturing;
+                if (virtualTexturing) {
+                    startVirtualTexturing();
+                }
+            }
+            break;
+
+        case GLFW_KEY_G:
+            if (action == GLFW_PRESS) {
+                pointLightCountIndex = (pointLightCountIndex + 1) % NumPointLightCounts;
+                std::cout << PointLightCounts[pointLightCountIndex] << " point lights" << std::endl;
+            }
+            break;
+
+        case GLFW_KEY_N:
+            if (action == GLFW_PRESS) {
+                sphereCountIndex = (sphereCountIndex + 1) % NumSphereCounts;
+                setSphereCount( SphereCounts[sphereCountIndex] );
+            }
+            break;
+
+        case GLFW_KEY_F1:
+            if (action == GLFW_PRESS) {
+                frameTimers.toggleOverlay();
+            }
+            break;
+
+        case GLFW_KEY_F2:
+            if (action == GLFW_PRESS) {
+                frameTimers.writeCsv(frameTimesFile);
+            }
+            break;
+
+        case GLFW_KEY_F3:
+            if (action == GLFW_PRESS) {
+                TraceProfiler::toggle(traceFile);
+            }
+            break;
         
         default:
             break;
@@ -632,6 +2128,8 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 
 {
     glViewport( 0, 0, width, height );
+    windowWidth = width;
+    windowHeight = height;
     
     GLfloat left = -2.0, right = 2.0;
     GLfloat top = 2.0, bottom = -2.0;
@@ -648,8 +2146,15 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height)
         bottom /= aspect;
     }
     
-    mat4 projection = Ortho( left, right, bottom, top, zNear, zFar );
-    glUniformMatrix4fv( Projection, 1, GL_TRUE, projection );
+    projection = Ortho( left, right, bottom, top, zNear, zFar );
+    viewLeft = left;
+    viewRight = right;
+    viewBottom = bottom;
+    viewTop = top;
+    for (const auto& variant : shaderVariants) {
+        glUseProgram(variant.second.program);
+        glUniformMatrix4fv( variant.second.projection, 1, GL_TRUE, projection );
+    }
 }
 
 //----------------------------------------------------------------------------
@@ -657,6 +2162,8 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 int
 main( int argc, char **argv )
 {
+    TraceProfiler::startFromEnvironment();
+    TraceProfiler::nameThread("main");
     
     if (!glfwInit())
             exit(EXIT_FAILURE);
@@ -684,7 +2191,9 @@ main( int argc, char **argv )
 
     while (!glfwWindowShouldClose(window))
     {
+        frameTimers.beginFrame();
         display();
+        frameTimers.endFrame();
         glfwSwapBuffers(window);
         glfwPollEvents();
     }
@@ -0,0 +1,165 @@
+#version 410
+
+// Sphere vertex shader. One source for every configuration; the program
+// builder in main.cpp inserts these defines after the #version line:
+//   SHADING_PHONG    0 = Gouraud (light per vertex), 1 = Phong (per fragment)
+//   TEXTURED         sample the texture array
+//   LIGHT_AMBIENT, LIGHT_DIFFUSE, LIGHT_SPECULAR
+//                    terms of the illumination equation to include
+//   NUM_MATERIALS    size of the Materials array
+//   PROCEDURAL       generate the unit sphere from gl_VertexID instead of
+//                    reading it from the vertex buffer
+//   IMPOSTOR         draw a screen-aligned quad (a 4 vertex triangle strip)
+//                    in front of the sphere; fshader_sphere.glsl ray casts it
+//   DEFERRED_LIGHTING
+//                    the full-screen pass of deferred shading: one triangle
+//                    covering the window, no spheres
+// Spheres are drawn instanced: every instance is the unit sphere scaled by
+// its radius and moved to its centre before ModelView applies.
+
+#if PROCEDURAL
+uniform int Stacks;  // the sphere has Stacks x 2 * Stacks quads
+#elif !IMPOSTOR
+layout(location = 0) in vec4 vPosition;  // on the unit sphere, so also the normal
+layout(location = 2) in vec2 vTexCoord;
+#endif
+layout(location = 3) in vec3 vInstance;  // centre x, centre y, radius
+layout(location = 4) in vec2 vStyle;     // texture layer, material index
+
+// The depth pre-pass and the shading pass must produce identical depths
+invariant gl_Position;
+
+flat out float textureLayer;
+
+#if DEFERRED_LIGHTING
+flat out mat4 inverseProjection;  // window depth back to eye coordinates
+#elif IMPOSTOR
+// Eye coordinates of the quad and of the sphere it stands for
+out vec3 quadPosition;
+flat out vec3 centre;
+flat out float radius;
+flat out int material;
+#else
+out vec2 texCoord;
+
+#if SHADING_PHONG
+// output values that will be interpretated per-fragment
+out vec3 fN;
+out vec3 fV;
+out vec3 fL;
+flat out int material;
+#else
+out vec4 color;
+#endif
+#endif
+
+uniform mat4 ModelView;
+uniform mat4 Projection;
+uniform mat4 Rotation;  // shared by every sphere
+
+struct Material {
+    vec4 AmbientProduct, DiffuseProduct, SpecularProduct;
+    float Shininess;
+};
+
+layout(std140) uniform LightingBlock {
+    Material Materials[NUM_MATERIALS];
+    vec4 LightPosition;
+};
+
+#if !SHADING_PHONG && !IMPOSTOR
+vec4 shade(vec3 N, vec3 L, vec3 V, Material m)
+{
+    vec4 result = vec4(0.0, 0.0, 0.0, 1.0);
+    float NdotL = dot(L, N);
+#if LIGHT_AMBIENT
+    result += m.AmbientProduct;
+#endif
+#if LIGHT_DIFFUSE
+    result += max(NdotL, 0.0) * m.DiffuseProduct; //set diffuse to 0 if light is behind the surface point
+#endif
+#if LIGHT_SPECULAR
+    vec3 H = normalize(L + V); // halfway vector
+    float Ks = pow(max(dot(N, H), 0.0), m.Shininess);
+    result += step(0.0, NdotL) * Ks * m.SpecularProduct; //ignore also specular component if light is behind the surface point
+#endif
+    result.a = 1.0;
+    return result;
+}
+#endif
+
+#if PROCEDURAL
+// Quad corners (slice, stack) of the two counter-clockwise triangles
+const ivec2 QuadCorners[6] = ivec2[6](ivec2(0, 0), ivec2(1, 1), ivec2(1, 0),
+                                      ivec2(0, 0), ivec2(0, 1), ivec2(1, 1));
+
+// Vertex gl_VertexID of the UV sphere, with the same equirectangular
+// mapping the mesh uses: s = 0.5 + atan(x, z) / 2pi, t = 0.5 - asin(y) / pi.
+// The seam repeats its column at s = 0 and s = 1.
+vec4 sphereVertex(out vec2 uv)
+{
+    int slices = 2 * Stacks;
+    int quad = gl_VertexID / 6;
+    ivec2 corner = ivec2(quad % slices, quad / slices) + QuadCorners[gl_VertexID % 6];
+    uv = vec2(corner) / vec2(slices, Stacks);
+
+    const float PI = 3.14159265;
+    float longitude = (uv.s - 0.5) * 2.0 * PI;
+    float latitude = (0.5 - uv.t) * PI;
+    return vec4(cos(latitude) * sin(longitude), sin(latitude), cos(latitude) * cos(longitude), 1.0);
+}
+#endif
+
+void main()
+{
+#if DEFERRED_LIGHTING
+    // Corners (-1, -1), (3, -1), (-1, 3): the window is inside the triangle
+    gl_Position = vec4(vec2(gl_VertexID & 1, gl_VertexID >> 1) * 4.0 - 1.0, 0.0, 1.0);
+    inverseProjection = inverse(Projection);
+#else
+    textureLayer = vStyle.x;
+
+#if IMPOSTOR
+    // ModelView is a uniform scale, so the sphere stays a sphere in eye
+    // coordinates. The quad faces the viewer just in front of it.
+    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2.0 - 1.0;
+    centre = (ModelView * vec4(vInstance.xy, 0.0, 1.0)).xyz;
+    radius = vInstance.z * length(ModelView[0].xyz);
+    quadPosition = centre + vec3(corner * radius, radius);
+    material = int(vStyle.y);
+    gl_Position = Projection * vec4(quadPosition, 1.0);
+#else
+#if PROCEDURAL
+    vec2 vTexCoord;
+    vec4 vPosition = sphereVertex(vTexCoord);
+#endif
+
+    // Place this instance's sphere in the scene
+    vec4 local = Rotation * vPosition;
+    vec4 position = vec4(local.xyz * vInstance.z + vec3(vInstance.xy, 0.0), 1.0);
+    vec4 normal = Rotation * vec4(vPosition.xyz, 0.0);
+
+    // Transform vertex position into camera (eye) coordinates
+    vec3 pos = (ModelView * position).xyz;
+
+    // Light direction: w = 0 is a directional light, w = 1 a point light
+    vec3 L = LightPosition.xyz - pos * LightPosition.w;
+
+#if SHADING_PHONG
+    fN = (ModelView * normal).xyz; // normal direction in camera coordinates
+    fV = -pos; //viewer direction in camera coordinates
+    fL = L;
+    material = int(vStyle.y);
+#else
+    // Transform vertex normal into camera coordinates
+    vec3 N = normalize( ModelView * normal ).xyz;
+    color = shade(N, normalize(L), normalize(-pos), Materials[int(vStyle.y)]);
+#endif
+
+    gl_Position = Projection * ModelView * position;
+
+    // Pass texture coordinates to fragment shader
+    texCoord = vTexCoord;
+#endif
+#endif
+}